@@ -0,0 +1,224 @@
+/*
+ *  This file is part of the LZPL: Linux ZFS Posix Layer
+ *
+ *  Copyright (c) 2010 Knowledge Quest Infotech Pvt. Ltd.
+ *  Produced at Knowledge Quest Infotech Pvt. Ltd.
+ *  Written by: Knowledge Quest Infotech Pvt. Ltd.
+ *              zfs@kqinfotech.com
+ *
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#ifndef _LZFS_H
+#define _LZFS_H
+
+#include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/backing-dev.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <sys/vfs.h>
+#include <sys/vnode.h>
+#include <sys/condvar.h>
+#include <sys/lzfs_inode.h>
+
+/* Token bucket, see lzfs_throttle.c */
+typedef struct lzfs_tbucket {
+	spinlock_t	tb_lock;
+	uint64_t	tb_rate;	/* tokens per second, 0 for no limit */
+	int64_t		tb_tokens;	/* negative while in debt */
+	unsigned long	tb_stamp;	/* jiffies of the last refill */
+	uint32_t	tb_part;	/* HZ-ths of a token refilled too */
+} lzfs_tbucket_t;
+
+/* lv_tb */
+#define LZFS_TB_RBYTES	0
+#define LZFS_TB_WBYTES	1
+#define LZFS_TB_RIOPS	2
+#define LZFS_TB_WIOPS	3
+#define LZFS_TB_NR	4
+
+/* I/O counters per direction, in /proc/fs/lzfs/<n> */
+typedef struct lzfs_iostat {
+	atomic64_t	is_bytes;
+	atomic64_t	is_ops;
+	atomic64_t	is_throttled;	/* calls that were delayed */
+	atomic64_t	is_throttle_ms;	/* total delay */
+} lzfs_iostat_t;
+
+/*
+ * State lzfs keeps per mount next to the vfs_t it shares with zfs. The
+ * vfs_t comes first, sb->s_fs_info points at it and is freed with it.
+ */
+typedef struct lzfs_vfs {
+	vfs_t		lv_vfs;
+	int		lv_flags;		/* LZFS_MNT_* */
+	struct backing_dev_info lv_bdi;		/* lzfs-<n> in sysfs */
+	int		lv_id;			/* the <n> */
+	char		*lv_name;		/* dataset */
+	struct proc_dir_entry *lv_proc;
+
+	/* limits and counters, see lzfs_throttle */
+	int		lv_limited;		/* a rate is set */
+	lzfs_tbucket_t	lv_tb[LZFS_TB_NR];
+	lzfs_iostat_t	lv_stat[2];		/* READ, WRITE */
+
+	/* fsync group commit, see lzfs_sync_commit */
+	kmutex_t	lv_sync_lock;
+	kcondvar_t	lv_sync_cv;
+	uint64_t	lv_sync_gen;		/* commit being gathered */
+	uint64_t	lv_sync_done;		/* last commit completed */
+	int		lv_sync_joined;		/* requests in lv_sync_gen */
+	int		lv_sync_busy;		/* a commit is running */
+	int		lv_sync_waiters;	/* yet to take lv_sync_error */
+	int		lv_sync_error;		/* result of lv_sync_done */
+
+	/* background frees, under lzfs_free_lock, see lzfs_free.c */
+	int		lv_free_pending;	/* frees queued or running */
+	uint64_t	lv_free_bytes;		/* file bytes they free */
+
+	/* cached directory listings, see lzfs_dircache.c */
+	atomic64_t	lv_dc_hits;		/* readdirs served from memory */
+	atomic64_t	lv_dc_misses;		/* and from ZFS */
+	atomic64_t	lv_dc_bytes;
+} lzfs_vfs_t;
+
+/* lv_flags */
+#define LZFS_MNT_WRITEBEHIND	0x0001	/* coalesce small writes */
+#define LZFS_MNT_ASYNCFREE	0x0002	/* free large files in background */
+#define LZFS_MNT_READDIRPLUS	0x0004	/* readdir instantiates the entries */
+#define LZFS_MNT_DIRCACHE	0x0008	/* keep directory listings */
+
+#define LZFS_VFSTOLV(vfsp)	container_of((vfsp), lzfs_vfs_t, lv_vfs)
+#define LZFS_SBTOLV(sb)		LZFS_VFSTOLV((vfs_t *)(sb)->s_fs_info)
+
+typedef struct lzfs_dircache lzfs_dircache_t;
+
+/*
+ * State lzfs keeps per vnode. Every inode of an lzfs super block is
+ * allocated by lzfs_alloc_vnode as one of these, with the vnode_t (and so
+ * the inode) first.
+ */
+typedef struct lzfs_vnode {
+	vnode_t			lz_vnode;
+	unsigned long		lz_flags;	/* LZFS_VN_* bits */
+	int			lz_mapcnt;	/* vmas, under v_lock */
+	int			lz_free_error;	/* failed background truncate */
+	uint64_t		lz_sync_gen;	/* see lzfs_sync_commit */
+
+	/* attributes cached for getattr, see lzfs_vnop_getattr */
+	spinlock_t		lz_attr_lock;
+	unsigned long		lz_attr_gen;	/* bumped by invalidation */
+	vattr_t			lz_attr;
+	unsigned long		lz_data_stamp;	/* jiffies of last data change */
+
+	/* listing of a directory, under its i_mutex */
+	lzfs_dircache_t		*lz_dircache;
+
+	/* byte range locks of reads and writes, see lzfs_rl_enter */
+	spinlock_t		lz_rl_lock;
+	struct list_head	lz_rl_list;
+	wait_queue_head_t	lz_rl_wait;
+
+	/* write-behind buffer, see lzfs_wb_write */
+	kmutex_t		lz_wb_lock;
+	char			*lz_wb_buf;
+	loff_t			lz_wb_off;	/* file offset of lz_wb_buf */
+	size_t			lz_wb_len;	/* bytes buffered */
+	int			lz_wb_error;	/* failed background flush */
+	struct list_head	lz_wb_node;	/* on lzfs_wb_list */
+} lzfs_vnode_t;
+
+/* lz_flags */
+#define LZFS_VN_DATA_DIRTY	0	/* data written since last commit */
+#define LZFS_VN_FREEING		1	/* truncate freeing in background */
+#define LZFS_VN_INACTIVE	2	/* zfs_inactive in background */
+#define LZFS_VN_PUT		3	/* one of destroy_inode and zfs_inactive done */
+#define LZFS_VN_ATTR_VALID	4	/* lz_attr is current */
+#define LZFS_VN_DATA_CHANGED	5	/* lz_data_stamp is set */
+#define LZFS_VN_DIRCACHE_BIG	6	/* listing did not fit the cache */
+#define LZFS_VN_DIRCACHE_STALE	7	/* .. moved, drop the listing */
+
+#define LZFS_VTOLZ(vp)		container_of((vp), lzfs_vnode_t, lz_vnode)
+#define LZFS_ITOLZ(ip)		LZFS_VTOLZ(LZFS_ITOV(ip))
+
+/*
+ * Drops the attributes cached for getattr, called after every change lzfs
+ * makes to them. Bumping lz_attr_gen keeps a getattr that read them from
+ * ZFS before the change from caching what it read.
+ */
+static inline void
+lzfs_attr_invalidate(struct inode *inode)
+{
+	lzfs_vnode_t *lz = LZFS_ITOLZ(inode);
+
+	spin_lock(&lz->lz_attr_lock);
+	lz->lz_attr_gen++;
+	clear_bit(LZFS_VN_ATTR_VALID, &lz->lz_flags);
+	spin_unlock(&lz->lz_attr_lock);
+}
+
+/* After a read through ZFS, which moves atime on atime mounts */
+static inline void
+lzfs_attr_accessed(struct inode *inode)
+{
+	if (vfs_isatime((vfs_t *)inode->i_sb->s_fs_info))
+		lzfs_attr_invalidate(inode);
+}
+
+/* Data reaches ZFS, fdatasync has something to commit for the file */
+static inline void
+lzfs_mark_data_dirty(vnode_t *vp)
+{
+	lzfs_vnode_t *lz = LZFS_VTOLZ(vp);
+
+	set_bit(LZFS_VN_DATA_DIRTY, &lz->lz_flags);
+	lz->lz_data_stamp = jiffies;
+	set_bit(LZFS_VN_DATA_CHANGED, &lz->lz_flags);
+	lzfs_attr_invalidate(LZFS_VTOI(vp));
+}
+
+/* lzfs_throttle.c */
+extern void lzfs_throttle_init(lzfs_vfs_t *lvp);
+extern void lzfs_throttle_set(lzfs_vfs_t *lvp, int which, uint64_t rate);
+extern void lzfs_throttle(struct inode *inode, int rw, ssize_t done);
+extern int lzfs_stat_init(void);
+extern void lzfs_stat_fini(void);
+extern void lzfs_stat_register(lzfs_vfs_t *lvp);
+extern void lzfs_stat_unregister(lzfs_vfs_t *lvp);
+
+/* lzfs_free.c */
+extern int lzfs_free_init(void);
+extern void lzfs_free_fini(void);
+extern int lzfs_free_inactive(struct inode *inode);
+extern int lzfs_free_truncate(struct inode *inode, loff_t size);
+extern void lzfs_free_wait(struct inode *inode);
+extern int lzfs_free_error(struct inode *inode);
+extern void lzfs_free_wait_all(lzfs_vfs_t *lvp);
+
+/* lzfs_dircache.c */
+extern int lzfs_dircache_read(struct inode *inode, void *dirent,
+		filldir_t filldir, loff_t *ppos);
+extern void lzfs_dircache_drop(struct inode *inode);
+
+/* lzfs_super.c */
+extern void lzfs_vnode_put(lzfs_vnode_t *lz);
+
+/* lzfs_vnops.c */
+extern void lzfs_wb_init(lzfs_vnode_t *lz);
+extern void lzfs_wb_release(struct inode *inode);
+extern void lzfs_wb_discard(struct inode *inode);
+
+#endif /* _LZFS_H */
@@ -0,0 +1,250 @@
+/*
+ *  This file is part of the LZPL: Linux ZFS Posix Layer
+ *
+ *  Copyright (c) 2010 Knowledge Quest Infotech Pvt. Ltd.
+ *  Produced at Knowledge Quest Infotech Pvt. Ltd.
+ *  Written by: Knowledge Quest Infotech Pvt. Ltd.
+ *              zfs@kqinfotech.com
+ *
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+/*
+ * Cached directory listings.
+ *
+ * On a dircache mount a readdir from the start of a directory lists all of
+ * it with zfs_readdir into page sized chunks of lzfs_dc_ent_t kept with
+ * the directory vnode. The listing serves every later readdir until one of
+ * the namespace operations changes the directory and drops it, all under
+ * i_mutex of the directory. Only rename changes a directory (its ..) 
+ * without that i_mutex, it marks the listing LZFS_VN_DIRCACHE_STALE for 
+ * the next readdir to drop. The f_pos of a cached readdir is the offset
+ * zfs_readdir gave the entry, so a listing continues the same with or
+ * without the cache.
+ *
+ * All listings together stay under lzfs_dircache_max bytes. A directory
+ * whose listing does not fit is read from ZFS until it changes. Cached
+ * readdirs do not move the atime of the directory.
+ */
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/moduleparam.h>
+#include <sys/vfs.h>
+#include <sys/vnode.h>
+
+#include "lzfs.h"
+
+static unsigned long lzfs_dircache_max = 64 << 20;
+module_param(lzfs_dircache_max, ulong, 0644);
+MODULE_PARM_DESC(lzfs_dircache_max, "Bytes all cached directory listings use at most");
+
+static atomic_long_t lzfs_dircache_used = ATOMIC_LONG_INIT(0);
+
+typedef struct lzfs_dc_ent {
+	u64		de_ino;
+	loff_t		de_off;		/* as given to filldir */
+	u16		de_len;
+	u8		de_type;
+	char		de_name[0];	/* not NUL terminated */
+} lzfs_dc_ent_t;
+
+#define LZFS_DC_ENTSIZE(len)	\
+	ALIGN(offsetof(lzfs_dc_ent_t, de_name) + (len), sizeof(u64))
+
+/* a page of entries */
+typedef struct lzfs_dc_chunk {
+	struct list_head	dk_node;
+	int			dk_used;	/* bytes of dk_data */
+	char			dk_data[0];
+} lzfs_dc_chunk_t;
+
+#define LZFS_DC_CHUNK_DATA	(PAGE_SIZE - offsetof(lzfs_dc_chunk_t, dk_data))
+
+struct lzfs_dircache {
+	struct list_head	dc_chunks;
+	int			dc_nchunks;
+	loff_t			dc_end;		/* f_pos past the last entry */
+	lzfs_dc_chunk_t		*dc_hint;	/* where the last readdir stopped */
+	int			dc_hint_off;
+};
+
+static void
+lzfs_dc_free(lzfs_vfs_t *lvp, lzfs_dircache_t *dc)
+{
+	lzfs_dc_chunk_t *k, *next;
+
+	list_for_each_entry_safe(k, next, &dc->dc_chunks, dk_node)
+		free_page((unsigned long)k);
+	atomic_long_sub(dc->dc_nchunks * PAGE_SIZE, &lzfs_dircache_used);
+	atomic64_sub(dc->dc_nchunks * PAGE_SIZE, &lvp->lv_dc_bytes);
+	kfree(dc);
+}
+
+static int
+lzfs_dc_filldir(void *arg, const char *name, int len, loff_t pos, u64 ino,
+		unsigned type)
+{
+	lzfs_dircache_t *dc = (lzfs_dircache_t *)arg;
+	lzfs_dc_chunk_t *k = NULL;
+	lzfs_dc_ent_t *de;
+	int size = LZFS_DC_ENTSIZE(len);
+
+	if (!list_empty(&dc->dc_chunks))
+		k = list_entry(dc->dc_chunks.prev, lzfs_dc_chunk_t, dk_node);
+	if (k == NULL || k->dk_used + size > LZFS_DC_CHUNK_DATA) {
+		if (atomic_long_add_return(PAGE_SIZE, &lzfs_dircache_used) >
+		    lzfs_dircache_max ||
+		    (k = (lzfs_dc_chunk_t *)__get_free_page(GFP_KERNEL)) == NULL) {
+			atomic_long_sub(PAGE_SIZE, &lzfs_dircache_used);
+			return -ENOSPC;
+		}
+		k->dk_used = 0;
+		list_add_tail(&k->dk_node, &dc->dc_chunks);
+		dc->dc_nchunks++;
+	}
+
+	de = (lzfs_dc_ent_t *)(k->dk_data + k->dk_used);
+	de->de_ino  = ino;
+	de->de_off  = pos;
+	de->de_len  = len;
+	de->de_type = type;
+	memcpy(de->de_name, name, len);
+	k->dk_used += size;
+	return 0;
+}
+
+/* Lists the whole directory into a new lz_dircache */
+static int
+lzfs_dc_build(struct inode *inode)
+{
+	lzfs_vnode_t *lz = LZFS_ITOLZ(inode);
+	lzfs_vfs_t *lvp = LZFS_SBTOLV(inode->i_sb);
+	lzfs_dircache_t *dc;
+	loff_t pos = 0;
+	int eof = 0, err;
+
+	if ((dc = kmalloc(sizeof(lzfs_dircache_t), GFP_KERNEL)) == NULL)
+		return ENOMEM;
+	INIT_LIST_HEAD(&dc->dc_chunks);
+	dc->dc_nchunks = 0;
+	dc->dc_hint    = NULL;
+
+	/* charged to the mount as it grows, lzfs_dc_free takes it back */
+	err = zfs_readdir(LZFS_ITOV(inode), dc, NULL, &eof, NULL, 0,
+			lzfs_dc_filldir, &pos);
+	atomic64_add(dc->dc_nchunks * PAGE_SIZE, &lvp->lv_dc_bytes);
+	if (err || !eof) {
+		/* does not fit, do not try again until the directory changes */
+		if (!err)
+			set_bit(LZFS_VN_DIRCACHE_BIG, &lz->lz_flags);
+		lzfs_dc_free(lvp, dc);
+		return err ? err : ENOSPC;
+	}
+	dc->dc_end = pos;
+	lz->lz_dircache = dc;
+	return 0;
+}
+
+/* Finds the entry at f_pos pos, from the hint or else from the start */
+static int
+lzfs_dc_seek(lzfs_dircache_t *dc, loff_t pos, lzfs_dc_chunk_t **kp, int *offp)
+{
+	lzfs_dc_chunk_t *k = dc->dc_hint;
+	int off = dc->dc_hint_off;
+
+	if (k && ((lzfs_dc_ent_t *)(k->dk_data + off))->de_off == pos)
+		goto found;
+	list_for_each_entry(k, &dc->dc_chunks, dk_node) {
+		for (off = 0; off < k->dk_used; off += LZFS_DC_ENTSIZE(
+				((lzfs_dc_ent_t *)(k->dk_data + off))->de_len))
+			if (((lzfs_dc_ent_t *)(k->dk_data + off))->de_off == pos)
+				goto found;
+	}
+	return 0;
+found:
+	*kp = k;
+	*offp = off;
+	return 1;
+}
+
+/*
+ * readdir of a dircache mount, i_mutex held. Returns 1 when the entries at
+ * *ppos were passed to filldir from the cached listing, 0 when the caller
+ * has to use zfs_readdir.
+ */
+int
+lzfs_dircache_read(struct inode *inode, void *dirent, filldir_t filldir,
+		loff_t *ppos)
+{
+	lzfs_vnode_t *lz = LZFS_ITOLZ(inode);
+	lzfs_vfs_t *lvp = LZFS_SBTOLV(inode->i_sb);
+	lzfs_dircache_t *dc;
+	lzfs_dc_chunk_t *k;
+	lzfs_dc_ent_t *de;
+	int off;
+
+	if (!(lvp->lv_flags & LZFS_MNT_DIRCACHE))
+		return 0;
+	if (test_and_clear_bit(LZFS_VN_DIRCACHE_STALE, &lz->lz_flags))
+		lzfs_dircache_drop(inode);
+	if (lz->lz_dircache == NULL &&
+	    (*ppos != 0 || test_bit(LZFS_VN_DIRCACHE_BIG, &lz->lz_flags) ||
+	    lzfs_dc_build(inode))) {
+		atomic64_inc(&lvp->lv_dc_misses);
+		return 0;
+	}
+
+	dc = lz->lz_dircache;
+	if (*ppos == dc->dc_end)
+		goto done;
+	if (!lzfs_dc_seek(dc, *ppos, &k, &off)) {
+		atomic64_inc(&lvp->lv_dc_misses);
+		return 0;
+	}
+
+	list_for_each_entry_from(k, &dc->dc_chunks, dk_node) {
+		for (; off < k->dk_used; off += LZFS_DC_ENTSIZE(de->de_len)) {
+			de = (lzfs_dc_ent_t *)(k->dk_data + off);
+			if (filldir(dirent, de->de_name, de->de_len,
+					de->de_off, de->de_ino, de->de_type)) {
+				*ppos = de->de_off;
+				dc->dc_hint     = k;
+				dc->dc_hint_off = off;
+				goto done;
+			}
+		}
+		off = 0;
+	}
+	*ppos = dc->dc_end;
+	dc->dc_hint = NULL;
+done:
+	atomic64_inc(&lvp->lv_dc_hits);
+	return 1;
+}
+
+/* Drops the listing of a directory, i_mutex held or the inode going away */
+void
+lzfs_dircache_drop(struct inode *inode)
+{
+	lzfs_vnode_t *lz = LZFS_ITOLZ(inode);
+
+	clear_bit(LZFS_VN_DIRCACHE_BIG, &lz->lz_flags);
+	if (lz->lz_dircache == NULL)
+		return;
+	lzfs_dc_free(LZFS_SBTOLV(inode->i_sb), lz->lz_dircache);
+	lz->lz_dircache = NULL;
+}
@@ -0,0 +1,328 @@
+/*
+ *  This file is part of the LZPL: Linux ZFS Posix Layer
+ *
+ *  Copyright (c) 2010 Knowledge Quest Infotech Pvt. Ltd.
+ *  Produced at Knowledge Quest Infotech Pvt. Ltd.
+ *  Written by: Knowledge Quest Infotech Pvt. Ltd.
+ *              zfs@kqinfotech.com
+ *
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+/*
+ * Background freeing of large files.
+ *
+ * With the asyncfree mount option the blocks of a regular file that loses
+ * its last link, or is truncated by at least lzfs_free_async_min bytes,
+ * are freed by the lzfs_free taskq rather than by the caller. The unlink
+ * or the new size is visible at once. A truncated tail is freed from the
+ * end in LZFS_FREE_CHUNK pieces, each a zfs_space call of its own, so
+ * that the free is spread over several txgs.
+ *
+ * Until a truncate is done ZFS still has the old size, so the paths that
+ * read, write or map the data wait for it in lzfs_free_wait; stat answers
+ * from i_size. A truncate that fails in the background is reported by the
+ * next fsync or close of the file, see lzfs_free_error. An unlinked file 
+ * has no users left, its vnode outlives destroy_inode until zfs_inactive 
+ * has returned.
+ *
+ * Frees not yet done are shown in /proc/fs/lzfs/<n>, unmount waits for
+ * them. The counts are under lzfs_free_lock, which outlives the mounts, 
+ * as the last free of a mount may still hold it when unmount goes on.
+ */
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/cred.h>
+#include <sys/vfs.h>
+#include <sys/vnode.h>
+#include <sys/taskq.h>
+#include <sys/tsd_hashtable.h>
+
+#include "lzfs.h"
+
+#ifndef F_FREESP
+#define F_FREESP	11
+#endif
+
+/* freed by one zfs_space call, the object may have far more blocks */
+#define LZFS_FREE_CHUNK		(1ULL << 30)
+
+/* symbol exported by zfs module */
+extern int zfs_space(vnode_t *vp, int cmd, flock64_t *bfp, int flag,
+		offset_t offset, cred_t *cr, caller_context_t *ct);
+
+static unsigned long lzfs_free_async_min = 64 << 20;
+module_param(lzfs_free_async_min, ulong, 0644);
+MODULE_PARM_DESC(lzfs_free_async_min,
+		"Bytes an asyncfree mount frees in the background at least");
+
+static int lzfs_free_threads = 4;
+module_param(lzfs_free_threads, int, 0444);
+MODULE_PARM_DESC(lzfs_free_threads, "Threads freeing files in the background");
+
+static taskq_t *lzfs_free_taskq = NULL;
+static kmutex_t lzfs_free_lock;
+static kcondvar_t lzfs_free_cv;
+
+typedef struct lzfs_free {
+	struct inode		*lf_inode;
+	loff_t			lf_size;	/* new size */
+	loff_t			lf_end;		/* old size */
+	const struct cred	*lf_cred;	/* the truncating process' */
+} lzfs_free_t;
+
+static inline int
+lzfs_free_async(struct inode *inode, loff_t bytes)
+{
+	return lzfs_free_taskq != NULL && S_ISREG(inode->i_mode) &&
+	    (LZFS_SBTOLV(inode->i_sb)->lv_flags & LZFS_MNT_ASYNCFREE) &&
+	    bytes >= lzfs_free_async_min;
+}
+
+static void
+lzfs_free_start(lzfs_vfs_t *lvp, loff_t bytes)
+{
+	mutex_enter(&lzfs_free_lock);
+	lvp->lv_free_pending++;
+	lvp->lv_free_bytes += bytes;
+	mutex_exit(&lzfs_free_lock);
+}
+
+static void
+lzfs_free_done(lzfs_vfs_t *lvp, loff_t bytes)
+{
+	mutex_enter(&lzfs_free_lock);
+	lvp->lv_free_pending--;
+	lvp->lv_free_bytes -= bytes;
+	cv_broadcast(&lzfs_free_cv);
+	mutex_exit(&lzfs_free_lock);
+}
+
+static void
+lzfs_free_inactive_work(void *arg)
+{
+	lzfs_free_t *lf = (lzfs_free_t *)arg;
+	struct inode *inode = lf->lf_inode;
+	lzfs_vfs_t *lvp = LZFS_SBTOLV(inode->i_sb);
+	vnode_t *vp = LZFS_ITOV(inode);
+
+	zfs_inactive(vp, NULL, NULL);
+	vp->v_data = NULL;
+	tsd_exit();
+
+	lzfs_vnode_put(LZFS_ITOLZ(inode));
+	lzfs_free_done(lvp, lf->lf_end);
+	kfree(lf);
+}
+
+/*
+ * Called by clear_inode in place of zfs_inactive, returns 1 when the
+ * inode is an unlinked file that zfs_inactive will free in the background.
+ */
+int
+lzfs_free_inactive(struct inode *inode)
+{
+	lzfs_vnode_t *lz = LZFS_ITOLZ(inode);
+	lzfs_vfs_t *lvp = LZFS_SBTOLV(inode->i_sb);
+	loff_t bytes = i_size_read(inode);
+	lzfs_free_t *lf;
+
+	if (inode->i_nlink || !lzfs_free_async(inode, bytes))
+		return 0;
+	/* inodes are also evicted under memory pressure, do not wait here */
+	if ((lf = kmalloc(sizeof(lzfs_free_t), GFP_NOFS)) == NULL)
+		return 0;
+	lf->lf_inode = inode;
+	lf->lf_size  = 0;
+	lf->lf_end   = bytes;
+	lf->lf_cred  = NULL;
+
+	set_bit(LZFS_VN_INACTIVE, &lz->lz_flags);
+	lzfs_free_start(lvp, bytes);
+	if (!taskq_dispatch(lzfs_free_taskq, lzfs_free_inactive_work, lf,
+			TQ_NOSLEEP)) {
+		clear_bit(LZFS_VN_INACTIVE, &lz->lz_flags);
+		lzfs_free_done(lvp, bytes);
+		kfree(lf);
+		return 0;
+	}
+	return 1;
+}
+
+static void
+lzfs_free_truncate_work(void *arg)
+{
+	lzfs_free_t *lf = (lzfs_free_t *)arg;
+	struct inode *inode = lf->lf_inode;
+	lzfs_vnode_t *lz = LZFS_ITOLZ(inode);
+	lzfs_vfs_t *lvp = LZFS_SBTOLV(inode->i_sb);
+	vnode_t *vp = LZFS_ITOV(inode);
+	loff_t start, end = lf->lf_end;
+	flock64_t bf;
+	int err = 0;
+
+	/* punch the tail from the end, then set the size with nothing left */
+	bzero(&bf, sizeof(flock64_t));
+	bf.l_type   = F_WRLCK;
+	bf.l_whence = 0;
+	while (end > lf->lf_size) {
+		start = lf->lf_size;
+		if (end - start > LZFS_FREE_CHUNK)
+			start = end - LZFS_FREE_CHUNK;
+		bf.l_start = start;
+		bf.l_len   = end - start;
+		if ((err = zfs_space(vp, F_FREESP, &bf, FWRITE, start,
+				(cred_t *)lf->lf_cred, NULL)))
+			break;
+		end = start;
+	}
+
+	if (!err) {
+		bf.l_start = lf->lf_size;
+		bf.l_len   = 0;
+		err = zfs_space(vp, F_FREESP, &bf, FWRITE, lf->lf_size,
+				(cred_t *)lf->lf_cred, NULL);
+	}
+	tsd_exit();
+	if (err)
+		printk(KERN_WARNING "lzfs: truncate of inode %lu to %lld "
+				"failed, error %d\n", inode->i_ino,
+				(long long)lf->lf_size, err);
+	else
+		lzfs_mark_data_dirty(vp);
+
+	mutex_enter(&lzfs_free_lock);
+	if (err)
+		lz->lz_free_error = err;
+	clear_bit(LZFS_VN_FREEING, &lz->lz_flags);
+	cv_broadcast(&lzfs_free_cv);
+	mutex_exit(&lzfs_free_lock);
+
+	/* still counted until the inode is let go, see lzfs_free_wait_all */
+	put_cred(lf->lf_cred);
+	iput(inode);
+	lzfs_free_done(lvp, lf->lf_end - lf->lf_size);
+	kfree(lf);
+}
+
+/*
+ * The size change of setattr, i_mutex held. Returns 1 when the file has
+ * been cut to size and its blocks past size are being freed in the
+ * background, 0 when the caller has to truncate it itself, or a negative
+ * errno.
+ */
+int
+lzfs_free_truncate(struct inode *inode, loff_t size)
+{
+	lzfs_vnode_t *lz = LZFS_ITOLZ(inode);
+	lzfs_vfs_t *lvp = LZFS_SBTOLV(inode->i_sb);
+	loff_t isize = i_size_read(inode);
+	lzfs_free_t *lf;
+	int err;
+
+	if (size >= isize || !lzfs_free_async(inode, isize - size))
+		return 0;
+	if ((lf = kmalloc(sizeof(lzfs_free_t), GFP_KERNEL)) == NULL)
+		return 0;
+	if ((err = vmtruncate(inode, size))) {
+		kfree(lf);
+		return err;
+	}
+	lf->lf_inode = igrab(inode);
+	lf->lf_size  = size;
+	lf->lf_end   = isize;
+	lf->lf_cred  = get_current_cred();
+
+	set_bit(LZFS_VN_FREEING, &lz->lz_flags);
+	lzfs_free_start(lvp, isize - size);
+	if (!taskq_dispatch(lzfs_free_taskq, lzfs_free_truncate_work, lf,
+			TQ_SLEEP))
+		lzfs_free_truncate_work(lf);
+	return 1;
+}
+
+/* Waits for a truncate of the file that is still being freed */
+void
+lzfs_free_wait(struct inode *inode)
+{
+	lzfs_vnode_t *lz = LZFS_ITOLZ(inode);
+
+	if (!test_bit(LZFS_VN_FREEING, &lz->lz_flags))
+		return;
+
+	mutex_enter(&lzfs_free_lock);
+	while (test_bit(LZFS_VN_FREEING, &lz->lz_flags))
+		cv_wait(&lzfs_free_cv, &lzfs_free_lock);
+	mutex_exit(&lzfs_free_lock);
+}
+
+/*
+ * Waits for a truncate still being freed and returns the error of the 
+ * last one that failed, once, for fsync and close. i_size is smaller than
+ * the size ZFS kept, which the file has again when next read from disk.
+ */
+int
+lzfs_free_error(struct inode *inode)
+{
+	lzfs_vnode_t *lz = LZFS_ITOLZ(inode);
+	int err;
+
+	lzfs_free_wait(inode);
+	if (!lz->lz_free_error)
+		return 0;
+
+	mutex_enter(&lzfs_free_lock);
+	err = lz->lz_free_error;
+	lz->lz_free_error = 0;
+	mutex_exit(&lzfs_free_lock);
+	return -err;
+}
+
+/* Waits for all frees of the mount, for unmount */
+void
+lzfs_free_wait_all(lzfs_vfs_t *lvp)
+{
+	mutex_enter(&lzfs_free_lock);
+	while (lvp->lv_free_pending)
+		cv_wait(&lzfs_free_cv, &lzfs_free_lock);
+	mutex_exit(&lzfs_free_lock);
+}
+
+int
+lzfs_free_init(void)
+{
+	mutex_init(&lzfs_free_lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&lzfs_free_cv, NULL, CV_DEFAULT, NULL);
+	lzfs_free_taskq = taskq_create("lzfs_free", lzfs_free_threads,
+			minclsyspri, lzfs_free_threads, INT_MAX,
+			TASKQ_PREPOPULATE);
+	if (lzfs_free_taskq == NULL) {
+		cv_destroy(&lzfs_free_cv);
+		mutex_destroy(&lzfs_free_lock);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void
+lzfs_free_fini(void)
+{
+	taskq_destroy(lzfs_free_taskq);
+	lzfs_free_taskq = NULL;
+	cv_destroy(&lzfs_free_cv);
+	mutex_destroy(&lzfs_free_lock);
+}
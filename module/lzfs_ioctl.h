@@ -0,0 +1,53 @@
+/*
+ *  This file is part of the LZPL: Linux ZFS Posix Layer
+ *
+ *  Copyright (c) 2010 Knowledge Quest Infotech Pvt. Ltd.
+ *  Produced at Knowledge Quest Infotech Pvt. Ltd.
+ *  Written by: Knowledge Quest Infotech Pvt. Ltd.
+ *              zfs@kqinfotech.com
+ *
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+/*
+ * ioctls of lzfs files, shared with user space: this header only uses
+ * types both sides have.
+ */
+
+#ifndef _LZFS_IOCTL_H
+#define _LZFS_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * LZFS_IOC_COPY_RANGE, issued on the destination file: copy_file_range(2)
+ * between two files of lzfs mounts. Copies up to lcr_len bytes at
+ * lcr_src_off of the file open as lcr_src_fd to lcr_dst_off, holes of the
+ * source stay holes. Returns the number of bytes copied, which is short
+ * at the end of the source and may be short for very long ranges, and
+ * advances both offsets by it. lcr_flags must be 0.
+ */
+struct lzfs_copy_range {
+	__s64	lcr_src_fd;
+	__u64	lcr_src_off;
+	__u64	lcr_dst_off;
+	__u64	lcr_len;
+	__u64	lcr_flags;
+};
+
+#define LZFS_IOC_COPY_RANGE	_IOWR('L', 0x01, struct lzfs_copy_range)
+
+#endif /* _LZFS_IOCTL_H */
@@ -391,7 +391,7 @@ lzfs_zfsctl_create(vfs_t *vfsp)
 	return;
 dentry_out:
 	// free vnode
-	vn_free(vp_zfsctl_dir);
+	iput(inode_ctldir);
 	ASSERT(0 && "TODO");
 }
 
@@ -42,6 +42,8 @@
 
 #include <sys/mntent.h>
 
+#include "lzfs.h"
+
 #ifdef DEBUG_SUBSYSTEM
 #undef DEBUG_SUBSYSTEM
 #endif
@@ -55,9 +57,16 @@ extern int zfs_umount(vfs_t *vfsp, int fflags, cred_t *cr);
 extern int zfs_statvfs(vfs_t *vfsp, struct statvfs64 *statp);
 extern void lzfs_zfsctl_create(vfs_t *);
 extern void lzfs_zfsctl_destroy(vfs_t *);
+extern int lzfs_vnops_init(void);
+extern void lzfs_vnops_fini(void);
+
+static kmem_cache_t *lzfs_vnode_cache = NULL;
+static atomic_t lzfs_bdi_seq = ATOMIC_INIT(0);
 
 static void lzfs_delete_vnode(struct inode *inode)
 {
+	/* the file is gone, so is whatever was buffered for it */
+	lzfs_wb_discard(inode);
 	truncate_inode_pages(&inode->i_data, 0);
 	clear_inode(inode);
 	inode->i_size = 0; 
@@ -72,6 +81,8 @@ lzfs_clear_vnode(struct inode *inode)
 	vp = LZFS_ITOV(inode);
 	
 	ASSERT(vp->v_count == 1);
+
+	lzfs_wb_release(inode);
 	
 	/* znode associated with this vnode is freed by zfs_inactive.
 	 *
@@ -85,6 +96,11 @@ lzfs_clear_vnode(struct inode *inode)
 		&& inode->i_ino != LZFS_ZFSCTL_INO_SNAPDIR
 		&& inode->i_private == NULL ) { 
 			if(!((vfs_t *)inode->i_sb->s_fs_info)->is_snap) {
+				if (lzfs_free_inactive(inode)) {
+					/* v_data is cleared by the free */
+					EXIT;
+					return;
+				}
 				zfs_inactive(vp, NULL, NULL);
 			}
 	}
@@ -95,32 +111,78 @@ lzfs_clear_vnode(struct inode *inode)
 static void
 lzfs_put_super(struct super_block *sb)
 {
+	lzfs_vfs_t *lvp = LZFS_SBTOLV(sb);
+
 	ENTRY;
+
+	lzfs_stat_unregister(lvp);
+	/* files unlinked by the eviction of the inodes */
+	lzfs_free_wait_all(lvp);
 	zfs_umount(sb->s_fs_info, 0, NULL);
+	bdi_destroy(&lvp->lv_bdi);
+	kfree(lvp->lv_name);
+	mutex_destroy(&lvp->lv_sync_lock);
+	cv_destroy(&lvp->lv_sync_cv);
 	kfree(sb->s_fs_info);
 	EXIT;
 }
 
+/*
+ * write_inode is how writeback and sync reach a file with write-behind data,
+ * lzfs_wb_write dirties the inode when it starts buffering.
+ */
+static int
+lzfs_write_vnode(struct inode *inode, int wait)
+{
+	lzfs_wb_release(inode);
+	return 0;
+}
+
 static struct inode *
 lzfs_alloc_vnode(struct super_block *sb) 
 {
+	lzfs_vnode_t *lz = NULL;
 	vnode_t *vp = NULL;
 	
 	ENTRY;
-	vp = vn_alloc(KM_SLEEP); 
-	bzero(vp, sizeof(vnode_t));
+	lz = kmem_cache_alloc(lzfs_vnode_cache, KM_SLEEP);
+	bzero(lz, sizeof(lzfs_vnode_t));
+	vp = &lz->lz_vnode;
 	mutex_init(&vp->v_lock, NULL, MUTEX_DEFAULT, NULL);
+	/* the ZIL may hold writes of an earlier instance of the file */
+	set_bit(LZFS_VN_DATA_DIRTY, &lz->lz_flags);
+	spin_lock_init(&lz->lz_attr_lock);
+	spin_lock_init(&lz->lz_rl_lock);
+	INIT_LIST_HEAD(&lz->lz_rl_list);
+	init_waitqueue_head(&lz->lz_rl_wait);
+	lzfs_wb_init(lz);
 	inode_init_once(LZFS_VTOI(vp));
 	LZFS_VTOI(vp)->i_version = 1;
 	EXIT;
 	return LZFS_VTOI(vp);
 }
 
+/*
+ * The vnode of an unlinked file whose zfs_inactive runs in the background
+ * outlives destroy_inode, the later of the two frees it.
+ */
+void
+lzfs_vnode_put(lzfs_vnode_t *lz)
+{
+	if (test_bit(LZFS_VN_INACTIVE, &lz->lz_flags) &&
+	    !test_and_set_bit(LZFS_VN_PUT, &lz->lz_flags))
+		return;
+
+	mutex_destroy(&lz->lz_wb_lock);
+	mutex_destroy(&lz->lz_vnode.v_lock);
+	kmem_cache_free(lzfs_vnode_cache, lz);
+}
+
 static void
 lzfs_destroy_vnode(struct inode *inode)
 {
-	mutex_destroy(&(LZFS_ITOV(inode))->v_lock);
-	vn_free(LZFS_ITOV(inode));	
+	lzfs_dircache_drop(inode);
+	lzfs_vnode_put(LZFS_ITOLZ(inode));
 }
 
 /* Structure to keep all the zfs related callback routines.
@@ -151,9 +213,121 @@ static int lzfs_statfs(struct dentry *dentry, struct kstatfs *statfs)
 }
 
 
+/*
+ * Options that are lzfs' own. The zfs mount helper hands its options to 
+ * the kernel as well, anything not in this table is left alone.
+ */
+enum {
+	Opt_writebehind, Opt_nowritebehind, Opt_asyncfree, Opt_noasyncfree,
+	Opt_readdirplus, Opt_noreaddirplus, Opt_dircache, Opt_nodircache,
+	Opt_rbps, Opt_wbps, Opt_riops, Opt_wiops, Opt_err
+};
+
+static const match_table_t lzfs_tokens = {
+	{Opt_writebehind,	"writebehind"},
+	{Opt_nowritebehind,	"nowritebehind"},
+	{Opt_asyncfree,		"asyncfree"},
+	{Opt_noasyncfree,	"noasyncfree"},
+	{Opt_readdirplus,	"readdirplus"},
+	{Opt_noreaddirplus,	"noreaddirplus"},
+	{Opt_dircache,		"dircache"},
+	{Opt_nodircache,	"nodircache"},
+	{Opt_rbps,		"rbps=%s"},
+	{Opt_wbps,		"wbps=%s"},
+	{Opt_riops,		"riops=%s"},
+	{Opt_wiops,		"wiops=%s"},
+	{Opt_err,		NULL}
+};
+
+/* I/O limits, per second with an optional K, M or G suffix, 0 is none */
+static int
+lzfs_parse_rate(substring_t *arg, uint64_t *rate)
+{
+	char *str, *end;
+
+	if ((str = match_strdup(arg)) == NULL)
+		return -ENOMEM;
+	*rate = memparse(str, &end);
+	if (*end != '\0' || end == str) {
+		kfree(str);
+		return -EINVAL;
+	}
+	kfree(str);
+	return 0;
+}
+
+static int
+lzfs_parse_options(char *options, lzfs_vfs_t *lvp)
+{
+	substring_t args[MAX_OPT_ARGS];
+	uint64_t rate;
+	int token, which, err, ret = 0;
+	char *p;
+
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		token = match_token(p, lzfs_tokens, args);
+		switch (token) {
+		case Opt_writebehind:
+			lvp->lv_flags |= LZFS_MNT_WRITEBEHIND;
+			break;
+		case Opt_nowritebehind:
+			lvp->lv_flags &= ~LZFS_MNT_WRITEBEHIND;
+			break;
+		case Opt_asyncfree:
+			lvp->lv_flags |= LZFS_MNT_ASYNCFREE;
+			break;
+		case Opt_noasyncfree:
+			lvp->lv_flags &= ~LZFS_MNT_ASYNCFREE;
+			break;
+		case Opt_readdirplus:
+			lvp->lv_flags |= LZFS_MNT_READDIRPLUS;
+			break;
+		case Opt_noreaddirplus:
+			lvp->lv_flags &= ~LZFS_MNT_READDIRPLUS;
+			break;
+		case Opt_dircache:
+			lvp->lv_flags |= LZFS_MNT_DIRCACHE;
+			break;
+		case Opt_nodircache:
+			lvp->lv_flags &= ~LZFS_MNT_DIRCACHE;
+			break;
+		case Opt_rbps:
+		case Opt_wbps:
+		case Opt_riops:
+		case Opt_wiops:
+			if ((err = lzfs_parse_rate(&args[0], &rate))) {
+				printk(KERN_WARNING "lzfs: bad value in %s\n", p);
+				ret = err;
+				break;
+			}
+			which = (token == Opt_rbps) ? LZFS_TB_RBYTES :
+			    (token == Opt_wbps) ? LZFS_TB_WBYTES :
+			    (token == Opt_riops) ? LZFS_TB_RIOPS : LZFS_TB_WIOPS;
+			lzfs_throttle_set(lvp, which, rate);
+			break;
+		default:
+			break;
+		}
+	}
+	return ret;
+}
+
+/* Only lzfs' own options change on remount, I/O limits among them */
+static int
+lzfs_remount_fs(struct super_block *sb, int *flags, char *data)
+{
+	return lzfs_parse_options(data, LZFS_SBTOLV(sb));
+}
+
 static int lzfs_show_options(struct seq_file *seq, struct vfsmount *vfsmnt)
 {
 	vfs_t *vfsp = lzfs_super(vfsmnt->mnt_sb);
+	lzfs_vfs_t *lvp = LZFS_VFSTOLV(vfsp);
 /*
 	if (vfs_isreadonly(vfsp))
 		seq_printf(seq, ",%s", MNTOPT_RO);
@@ -198,6 +372,27 @@ static int lzfs_show_options(struct seq_file *seq, struct vfsmount *vfsmnt)
 		/* Linux Kernel Displays noexec by default */
 		// seq_printf(seq, ",%s", MNTOPT_NOEXEC);
 	}
+
+	if (lvp->lv_flags & LZFS_MNT_WRITEBEHIND)
+		seq_printf(seq, ",writebehind");
+	if (lvp->lv_flags & LZFS_MNT_ASYNCFREE)
+		seq_printf(seq, ",asyncfree");
+	if (lvp->lv_flags & LZFS_MNT_READDIRPLUS)
+		seq_printf(seq, ",readdirplus");
+	if (lvp->lv_flags & LZFS_MNT_DIRCACHE)
+		seq_printf(seq, ",dircache");
+	if (lvp->lv_tb[LZFS_TB_RBYTES].tb_rate)
+		seq_printf(seq, ",rbps=%llu", (unsigned long long)
+				lvp->lv_tb[LZFS_TB_RBYTES].tb_rate);
+	if (lvp->lv_tb[LZFS_TB_WBYTES].tb_rate)
+		seq_printf(seq, ",wbps=%llu", (unsigned long long)
+				lvp->lv_tb[LZFS_TB_WBYTES].tb_rate);
+	if (lvp->lv_tb[LZFS_TB_RIOPS].tb_rate)
+		seq_printf(seq, ",riops=%llu", (unsigned long long)
+				lvp->lv_tb[LZFS_TB_RIOPS].tb_rate);
+	if (lvp->lv_tb[LZFS_TB_WIOPS].tb_rate)
+		seq_printf(seq, ",wiops=%llu", (unsigned long long)
+				lvp->lv_tb[LZFS_TB_WIOPS].tb_rate);
 	return 0;
 }
 
@@ -206,6 +401,8 @@ static const struct super_operations lzfs_ops = {
 	.clear_inode    =	lzfs_clear_vnode,
 	.delete_inode   =   lzfs_delete_vnode,
 	.destroy_inode	=	lzfs_destroy_vnode,
+	.write_inode	=	lzfs_write_vnode,
+	.remount_fs	=	lzfs_remount_fs,
 	.put_super	=	lzfs_put_super,
 	.statfs		= 	lzfs_statfs,
 	.show_options = lzfs_show_options,
@@ -215,15 +412,47 @@ static int
 lzfs_fill_super(struct super_block *sb, void *data, int silent)
 {
 	int error = 0;
+	lzfs_vfs_t *lvp = NULL;
 	vfs_t *vfsp = NULL;
 	vnode_t *root_vnode = NULL;
 	struct inode *root_inode = NULL;
 	struct dentry *root_dentry = NULL;
+	struct statvfs64 stat;
 	long ret = -EINVAL;
 	
 	ENTRY;
 
-	vfsp = (vfs_t *) kzalloc(sizeof(vfs_t), KM_SLEEP);
+	lvp = (lzfs_vfs_t *) kzalloc(sizeof(lzfs_vfs_t), KM_SLEEP);
+	mutex_init(&lvp->lv_sync_lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&lvp->lv_sync_cv, NULL, CV_DEFAULT, NULL);
+	lvp->lv_sync_gen = 1;
+	lzfs_throttle_init(lvp);
+	vfsp = &lvp->lv_vfs;
+
+	/*
+	 * Each mount has its own backing_dev_info, so that dirty mmap pages
+	 * are accounted and throttled per dataset like those of a block 
+	 * device filesystem, and so that readahead and the dirty ratios can 
+	 * be tuned in /sys/class/bdi/lzfs-<n>. lzfs_set_inode_ops points 
+	 * the mappings at it.
+	 */
+	lvp->lv_bdi.name = "lzfs";
+	lvp->lv_bdi.ra_pages = VM_MAX_READAHEAD * 1024 / PAGE_CACHE_SIZE;
+	lvp->lv_bdi.unplug_io_fn = default_unplug_io_fn;
+	if ((ret = bdi_init(&lvp->lv_bdi))) {
+		mutex_destroy(&lvp->lv_sync_lock);
+		cv_destroy(&lvp->lv_sync_cv);
+		kfree(lvp);
+		EXIT;
+		return ret;
+	}
+	lvp->lv_id = atomic_inc_return(&lzfs_bdi_seq);
+	ret = bdi_register(&lvp->lv_bdi, NULL, "lzfs-%d", lvp->lv_id);
+	if (ret)
+		goto mount_failed;
+	sb->s_bdi = &lvp->lv_bdi;
+	ret = -EINVAL;
+
 	vfsp->vfs_set_inode_ops = lzfs_set_inode_ops;
 	vfsp->vfs_super   =	sb;
 	sb->s_maxbytes	  =	MAX_LFS_FILESIZE;
@@ -246,8 +475,15 @@ lzfs_fill_super(struct super_block *sb, void *data, int silent)
 		vfsp->is_snap = 1;
 	}
 
-	sb->s_blocksize   =	vfsp->vfs_bsize;
-	sb->s_blocksize_bits = ilog2(vfsp->vfs_bsize);
+	/*
+	 * Advertise the dataset recordsize as the block size, it is what
+	 * st_blksize reports and what lzfs_vnop_read sizes its reads by.
+	 */
+	if (zfs_statvfs(vfsp, &stat) == 0 && stat.f_bsize)
+		sb->s_blocksize = stat.f_bsize;
+	else
+		sb->s_blocksize = vfsp->vfs_bsize;
+	sb->s_blocksize_bits = ilog2(sb->s_blocksize);
 	sb->s_time_gran = 1;
 
 
@@ -267,11 +503,18 @@ lzfs_fill_super(struct super_block *sb, void *data, int silent)
 	if (!strchr((char *) data, '@')) {
 		lzfs_zfsctl_create(vfsp);
 	}
+
+	lvp->lv_name = kstrdup((char *) data, GFP_KERNEL);
+	lzfs_stat_register(lvp);
 	EXIT;
 	return 0;
 
 mount_failed:
 	sb->s_fs_info = NULL;
+	sb->s_bdi = NULL;
+	bdi_destroy(&lvp->lv_bdi);
+	mutex_destroy(&lvp->lv_sync_lock);
+	cv_destroy(&lvp->lv_sync_cv);
 	kfree(vfsp);
 	EXIT;
 	return (ret);
@@ -300,6 +543,8 @@ lzfs_get_sb(struct file_system_type *fs_type,
 
 	vfsp = lzfs_super(mnt->mnt_sb);
 	vfsp->vfsmnt = mnt;
+	/* a bad value is reported and left out, the mount stands */
+	lzfs_parse_options(data, LZFS_VFSTOLV(vfsp));
 
 	/* copy the mount flags information (from Linux Kernel) to 
 	 * zfs file system 
@@ -348,6 +593,8 @@ lzfs_kill_sb(struct super_block *sb)
             if (!vfsp->is_snap) {
                 lzfs_zfsctl_destroy(sb->s_fs_info);
             }
+            /* background truncates hold their inodes */
+            lzfs_free_wait_all(LZFS_VFSTOLV(vfsp));
         }
 	kill_anon_super(sb);
 	EXIT;
@@ -363,13 +610,42 @@ struct file_system_type lzfs_fs_type = {
 static int 
 init_lzfs_fs(void)
 {
-	return register_filesystem(&lzfs_fs_type);
+	int rc;
+
+	lzfs_vnode_cache = kmem_cache_create("lzfs_vnode_cache", 
+			sizeof(lzfs_vnode_t), 0, NULL, NULL, NULL, NULL, NULL, 0);
+	if (lzfs_vnode_cache == NULL)
+		return -ENOMEM;
+
+	if ((rc = lzfs_vnops_init()))
+		goto out_cache;
+
+	if ((rc = lzfs_free_init()))
+		goto out_vnops;
+
+	lzfs_stat_init();
+	if ((rc = register_filesystem(&lzfs_fs_type)))
+		goto out_free;
+	return 0;
+
+out_free:
+	lzfs_stat_fini();
+	lzfs_free_fini();
+out_vnops:
+	lzfs_vnops_fini();
+out_cache:
+	kmem_cache_destroy(lzfs_vnode_cache);
+	return rc;
 }
 
 static void __exit 
 exit_lzfs_fs(void)
 {
 	unregister_filesystem(&lzfs_fs_type);
+	lzfs_stat_fini();
+	lzfs_free_fini();
+	lzfs_vnops_fini();
+	kmem_cache_destroy(lzfs_vnode_cache);
 }
 
 module_init(init_lzfs_fs)
@@ -0,0 +1,249 @@
+/*
+ *  This file is part of the LZPL: Linux ZFS Posix Layer
+ *
+ *  Copyright (c) 2010 Knowledge Quest Infotech Pvt. Ltd.
+ *  Produced at Knowledge Quest Infotech Pvt. Ltd.
+ *  Written by: Knowledge Quest Infotech Pvt. Ltd.
+ *              zfs@kqinfotech.com
+ *
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+/*
+ * Per mount I/O limits and statistics.
+ *
+ * Each mount has four token buckets, read and write bytes and read and
+ * write calls per second, set with the rbps, wbps, riops and wiops mount
+ * options and changed by remount. The read and write entry points charge
+ * them with the bytes actually transferred once the I/O is done, so a 
+ * read past the end of a file costs what it read. A bucket holds at most
+ * one second worth of tokens and is allowed to go into debt, the caller 
+ * then sleeps until its own charge is paid off. A large request thus 
+ * waits in proportion to its size, while the debt it leaves to the other
+ * callers of the mount is capped at one second worth.
+ *
+ * /proc/fs/lzfs/<n> shows the limits and counters of mount <n>, the same
+ * <n> as its backing_dev_info lzfs-<n>.
+ */
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/sched.h>
+#include <linux/jiffies.h>
+#include <linux/math64.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <sys/vfs.h>
+#include <sys/vnode.h>
+
+#include "lzfs.h"
+
+static struct proc_dir_entry *lzfs_proc_dir = NULL;
+
+void
+lzfs_throttle_init(lzfs_vfs_t *lvp)
+{
+	int i;
+
+	for (i = 0; i < LZFS_TB_NR; i++) {
+		spin_lock_init(&lvp->lv_tb[i].tb_lock);
+		lvp->lv_tb[i].tb_rate   = 0;
+		lvp->lv_tb[i].tb_tokens = 0;
+		lvp->lv_tb[i].tb_stamp  = jiffies;
+		lvp->lv_tb[i].tb_part   = 0;
+	}
+	lvp->lv_limited = 0;
+}
+
+void
+lzfs_throttle_set(lzfs_vfs_t *lvp, int which, uint64_t rate)
+{
+	lzfs_tbucket_t *tb = &lvp->lv_tb[which];
+	int i, limited = 0;
+
+	spin_lock(&tb->tb_lock);
+	tb->tb_rate   = rate;
+	tb->tb_tokens = rate;
+	tb->tb_stamp  = jiffies;
+	tb->tb_part   = 0;
+	spin_unlock(&tb->tb_lock);
+
+	for (i = 0; i < LZFS_TB_NR; i++)
+		if (lvp->lv_tb[i].tb_rate)
+			limited = 1;
+	lvp->lv_limited = limited;
+}
+
+/* Takes n tokens, returns the jiffies to wait for the bucket to recover */
+static long
+lzfs_tb_charge(lzfs_tbucket_t *tb, uint64_t n)
+{
+	unsigned long now = jiffies;
+	unsigned long elapsed;
+	uint64_t fill;
+	long wait = 0;
+
+	spin_lock(&tb->tb_lock);
+	if (tb->tb_rate) {
+		/* the bucket is full after a second anyway. The fraction of
+		 * a token that has refilled is carried to the next charge, 
+		 * or rates that are no multiple of HZ would refill slower */
+		elapsed = min_t(unsigned long, now - tb->tb_stamp, HZ);
+		fill = div_u64_rem(tb->tb_rate * elapsed + tb->tb_part, HZ, 
+				&tb->tb_part);
+		tb->tb_tokens += fill;
+		tb->tb_stamp = now;
+		if (tb->tb_tokens > (int64_t)tb->tb_rate)
+			tb->tb_tokens = tb->tb_rate;
+
+		tb->tb_tokens -= n;
+		if (tb->tb_tokens < 0)
+			wait = div64_u64(-tb->tb_tokens * HZ, tb->tb_rate) + 1;
+		if (tb->tb_tokens < -(int64_t)tb->tb_rate)
+			tb->tb_tokens = -(int64_t)tb->tb_rate;
+	}
+	spin_unlock(&tb->tb_lock);
+	return wait;
+}
+
+/*
+ * Accounts a read or write on the mount of inode that returned done, the
+ * bytes transferred or an error, and sleeps for as long as the limits of
+ * the mount require.
+ */
+void
+lzfs_throttle(struct inode *inode, int rw, ssize_t done)
+{
+	lzfs_vfs_t *lvp = LZFS_SBTOLV(inode->i_sb);
+	lzfs_iostat_t *st = &lvp->lv_stat[rw == WRITE];
+	size_t bytes = (done > 0) ? done : 0;
+	long wait, ops_wait;
+
+	atomic64_add(bytes, &st->is_bytes);
+	atomic64_inc(&st->is_ops);
+	if (!lvp->lv_limited)
+		return;
+
+	if (rw == WRITE) {
+		wait = lzfs_tb_charge(&lvp->lv_tb[LZFS_TB_WBYTES], bytes);
+		ops_wait = lzfs_tb_charge(&lvp->lv_tb[LZFS_TB_WIOPS], 1);
+	} else {
+		wait = lzfs_tb_charge(&lvp->lv_tb[LZFS_TB_RBYTES], bytes);
+		ops_wait = lzfs_tb_charge(&lvp->lv_tb[LZFS_TB_RIOPS], 1);
+	}
+	if (ops_wait > wait)
+		wait = ops_wait;
+
+	if (wait > 0) {
+		atomic64_inc(&st->is_throttled);
+		atomic64_add(jiffies_to_msecs(wait), &st->is_throttle_ms);
+		schedule_timeout_killable(wait);
+	}
+}
+
+static int
+lzfs_stat_show(struct seq_file *seq, void *v)
+{
+	lzfs_vfs_t *lvp = seq->private;
+	static const char *dir[2] = { "read", "write" };
+	int i;
+
+	seq_printf(seq, "dataset\t%s\n", lvp->lv_name);
+	seq_printf(seq, "rbps\t%llu\n",
+			(unsigned long long)lvp->lv_tb[LZFS_TB_RBYTES].tb_rate);
+	seq_printf(seq, "wbps\t%llu\n",
+			(unsigned long long)lvp->lv_tb[LZFS_TB_WBYTES].tb_rate);
+	seq_printf(seq, "riops\t%llu\n",
+			(unsigned long long)lvp->lv_tb[LZFS_TB_RIOPS].tb_rate);
+	seq_printf(seq, "wiops\t%llu\n",
+			(unsigned long long)lvp->lv_tb[LZFS_TB_WIOPS].tb_rate);
+	for (i = 0; i < 2; i++) {
+		lzfs_iostat_t *st = &lvp->lv_stat[i];
+
+		seq_printf(seq, "%s_bytes\t%lld\n", dir[i],
+				(long long)atomic64_read(&st->is_bytes));
+		seq_printf(seq, "%s_ops\t%lld\n", dir[i],
+				(long long)atomic64_read(&st->is_ops));
+		seq_printf(seq, "%s_throttled\t%lld\n", dir[i],
+				(long long)atomic64_read(&st->is_throttled));
+		seq_printf(seq, "%s_throttle_ms\t%lld\n", dir[i],
+				(long long)atomic64_read(&st->is_throttle_ms));
+	}
+	/* space that lzfs_free.c has yet to give back */
+	seq_printf(seq, "free_pending\t%d\n", lvp->lv_free_pending);
+	seq_printf(seq, "free_pending_bytes\t%llu\n",
+			(unsigned long long)lvp->lv_free_bytes);
+	seq_printf(seq, "dircache_hits\t%lld\n",
+			(long long)atomic64_read(&lvp->lv_dc_hits));
+	seq_printf(seq, "dircache_misses\t%lld\n",
+			(long long)atomic64_read(&lvp->lv_dc_misses));
+	seq_printf(seq, "dircache_bytes\t%lld\n",
+			(long long)atomic64_read(&lvp->lv_dc_bytes));
+	return 0;
+}
+
+static int
+lzfs_stat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lzfs_stat_show, PDE(inode)->data);
+}
+
+static const struct file_operations lzfs_stat_fops = {
+	.owner		= THIS_MODULE,
+	.open		= lzfs_stat_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+void
+lzfs_stat_register(lzfs_vfs_t *lvp)
+{
+	char name[16];
+
+	if (lzfs_proc_dir == NULL)
+		return;
+	snprintf(name, sizeof(name), "%d", lvp->lv_id);
+	lvp->lv_proc = proc_create_data(name, 0444, lzfs_proc_dir,
+			&lzfs_stat_fops, lvp);
+}
+
+void
+lzfs_stat_unregister(lzfs_vfs_t *lvp)
+{
+	char name[16];
+
+	if (lvp->lv_proc == NULL)
+		return;
+	snprintf(name, sizeof(name), "%d", lvp->lv_id);
+	remove_proc_entry(name, lzfs_proc_dir);
+	lvp->lv_proc = NULL;
+}
+
+int
+lzfs_stat_init(void)
+{
+	/* the statistics are a convenience, mounts work without them */
+	lzfs_proc_dir = proc_mkdir("fs/lzfs", NULL);
+	return 0;
+}
+
+void
+lzfs_stat_fini(void)
+{
+	if (lzfs_proc_dir)
+		remove_proc_entry("fs/lzfs", NULL);
+	lzfs_proc_dir = NULL;
+}
@@ -22,18 +22,74 @@
  */
 
 #include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/mmu_context.h>
+#include <linux/aio.h>
+#include <linux/falloc.h>
+#include <linux/compat.h>
+#include <linux/statfs.h>
 #include <sys/vnode.h>
+#include <sys/taskq.h>
 #include <sys/debug.h>
 #include <sys/tsd_hashtable.h>
 #include <linux/writeback.h>
+#include <linux/pagevec.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
 #include <sys/lzfs_snap.h>
 
+#include "lzfs.h"
+#include "lzfs_ioctl.h"
+
 #ifdef DEBUG_SUBSYSTEM
 #undef DEBUG_SUBSYSTEM
 #endif
 
 #define DEBUG_SUBSYSTEM S_LZFS
 
+/* largest number of pages filled by a single zfs_read in readpages */
+#define LZFS_READPAGES_MAX	((128 * 1024) >> PAGE_CACHE_SHIFT)
+
+/* lseek origins, only passed down by kernels that know about them */
+#ifndef SEEK_DATA
+#define SEEK_DATA	3
+#define SEEK_HOLE	4
+#endif
+
+/* Solaris hole/data ioctls, understood by zfs_ioctl */
+#ifndef _FIO_SEEK_DATA
+#define _FIO_SEEK_DATA	_IOWR('f', 81, offset_t)
+#define _FIO_SEEK_HOLE	_IOWR('f', 82, offset_t)
+#endif
+
+#ifndef FKIOCTL
+#define FKIOCTL		0x80000000
+#endif
+
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE	0x02
+#endif
+#ifndef FALLOC_FL_ZERO_RANGE
+#define FALLOC_FL_ZERO_RANGE	0x10
+#endif
+
+#ifndef F_FREESP
+#define F_FREESP	11
+#endif
+
+/* symbol exported by zfs module */
+extern int zfs_space(vnode_t *vp, int cmd, flock64_t *bfp, int flag,
+		offset_t offset, cred_t *cr, caller_context_t *ct);
+extern int zfs_statvfs(vfs_t *vfsp, struct statvfs64 *statp);
+extern int zfs_sync(vfs_t *vfsp, short flag, cred_t *cr);
+extern int zfs_ioctl(vnode_t *vp, int com, intptr_t data, int flag, 
+		cred_t *cred, int *rvalp, caller_context_t *ct);
+
+static int lzfs_wb_flush(struct inode *inode);
+static int lzfs_wb_sync(struct inode *inode);
+
 static int checkname(char *name) 
 {
 	if (strlen(name) >= MAXNAMELEN) {
@@ -43,24 +99,81 @@ static int checkname(char *name)
 	}
 }
 
+/*
+ * st_blocks of data that ZFS has not synced yet is an estimate, so what 
+ * zfs_getattr returns within this many seconds of a data change is not 
+ * cached.
+ */
+static int lzfs_attr_settle = 30;
+module_param(lzfs_attr_settle, int, 0644);
+MODULE_PARM_DESC(lzfs_attr_settle, "Seconds after a data change before getattr caches the attributes of a file");
+
+/*
+ * Reads the attributes of a file from ZFS and caches them in the vnode, 
+ * unless they were invalidated meanwhile or the data is too recent.
+ */
+static int
+lzfs_attr_fetch(struct inode *inode, vattr_t *vap, const struct cred *cred)
+{
+	lzfs_vnode_t *lz = LZFS_ITOLZ(inode);
+	unsigned long gen;
+	int err;
+
+	spin_lock(&lz->lz_attr_lock);
+	gen = lz->lz_attr_gen;
+	spin_unlock(&lz->lz_attr_lock);
+
+	err = zfs_getattr(LZFS_ITOV(inode), vap, 0, (struct cred *)cred, NULL);
+	if (err)
+		return err;
+
+	if (!test_bit(LZFS_VN_DATA_CHANGED, &lz->lz_flags) ||
+	    time_after(jiffies, lz->lz_data_stamp + lzfs_attr_settle * HZ)) {
+		spin_lock(&lz->lz_attr_lock);
+		if (lz->lz_attr_gen == gen) {
+			lz->lz_attr = *vap;
+			set_bit(LZFS_VN_ATTR_VALID, &lz->lz_flags);
+		}
+		spin_unlock(&lz->lz_attr_lock);
+	}
+	return 0;
+}
+
+/*
+ * getattr is answered from the attributes cached in the vnode when they 
+ * are valid, which they are until lzfs changes any of them: namespace 
+ * operations, setattr, writes, frees, and reads on atime mounts all call
+ * lzfs_attr_invalidate once ZFS is done. The size always comes from 
+ * i_size.
+ */
 static int lzfs_vnop_getattr(struct vfsmount *mnt, struct dentry *dentry, struct kstat *stat)
 {
 	struct inode *inode = dentry->d_inode;
-	vnode_t *vnode = NULL;
+	lzfs_vnode_t *lz = LZFS_ITOLZ(inode);
 	vattr_t vap;
-	const struct cred *cred = get_current_cred();
+	const struct cred *cred;
 	int err;
 
 	ENTRY;
-	vnode = LZFS_ITOV(inode);
+	lzfs_wb_flush(inode);
+
+	spin_lock(&lz->lz_attr_lock);
+	if (test_bit(LZFS_VN_ATTR_VALID, &lz->lz_flags)) {
+		vap = lz->lz_attr;
+		spin_unlock(&lz->lz_attr_lock);
+		goto fill;
+	}
+	spin_unlock(&lz->lz_attr_lock);
 
-	err = zfs_getattr(vnode, &vap, 0, (struct cred *) cred, NULL);
+	cred = get_current_cred();
+	err = lzfs_attr_fetch(inode, &vap, cred);
+	put_cred(cred);
+	tsd_exit();
 	if (err) {
-		put_cred(cred);
-		tsd_exit();
 		EXIT;
 		return PTR_ERR(ERR_PTR(-err));
 	}
+fill:
 
 	stat->dev   = vap.va_rdev;
 	stat->rdev  = vap.va_rdev;
@@ -74,11 +187,8 @@ static int lzfs_vnop_getattr(struct vfsmount *mnt, struct dentry *dentry, struct
 	stat->ctime = vap.va_ctime;
 	stat->size  = i_size_read(inode);
 	stat->blocks  = vap.va_nblocks;
-	stat->blksize = (1 << inode->i_blkbits);
-	// stat->blksize   = vap.va_blocksize;
-	//stat->blocks    = stat->size >> inode->i_blkbits;
-	put_cred(cred);
-	tsd_exit();
+	/* dataset recordsize, see lzfs_fill_super */
+	stat->blksize = inode->i_sb->s_blocksize;
 	EXIT;
 	return 0;
 }
@@ -113,6 +223,8 @@ lzfs_vnop_create(struct inode *dir, struct dentry *dentry, int mode,
 
 	err = zfs_create(dvp, (char *)dentry->d_name.name, vap, 0, mode,
 			 &vp, (struct cred *)cred, 0, NULL, NULL);
+	lzfs_attr_invalidate(dir);
+	lzfs_dircache_drop(dir);
 	put_cred(cred);
 	kfree(vap);
 	if (err) {
@@ -126,6 +238,107 @@ lzfs_vnop_create(struct inode *dir, struct dentry *dentry, int mode,
 	return 0;
 }
 
+/*
+ * readdirplus: a readdir of a readdirplus mount passes the names through 
+ * lzfs_rdplus_filldir, which keeps a page worth of them. Once the page is
+ * full, or the caller's buffer is, the names are looked up and entered in
+ * the dcache, along with the attributes for getattr, so that the stat of 
+ * every entry that usually follows a listing does not go to ZFS. zfs_readdir
+ * prefetches the dnodes itself once the directory has seen a lookup.
+ */
+typedef struct lzfs_rdplus {
+	void		*rp_dirent;	/* the caller's */
+	filldir_t	rp_filldir;
+	char		*rp_names;	/* NUL terminated, one after the other */
+	int		rp_used;	/* bytes of rp_names */
+	int		rp_count;	/* names in rp_names */
+	int		rp_stopped;	/* rp_names was full */
+	int		rp_done;	/* the caller's buffer was full */
+} lzfs_rdplus_t;
+
+static int
+lzfs_rdplus_filldir(void *arg, const char *name, int len, loff_t pos,
+		u64 ino, unsigned type)
+{
+	lzfs_rdplus_t *rp = (lzfs_rdplus_t *)arg;
+	int err;
+
+	/* the entry comes again with the next zfs_readdir */
+	if (rp->rp_used + len + 1 > PAGE_SIZE) {
+		rp->rp_stopped = 1;
+		return -ENOSPC;
+	}
+	if ((err = rp->rp_filldir(rp->rp_dirent, name, len, pos, ino, type))) {
+		rp->rp_done = 1;
+		return err;
+	}
+	if (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.')))
+		return 0;
+	memcpy(rp->rp_names + rp->rp_used, name, len);
+	rp->rp_names[rp->rp_used + len] = '\0';
+	rp->rp_used += len + 1;
+	rp->rp_count++;
+	return 0;
+}
+
+/* Instantiates the names of rp not in the dcache yet, i_mutex of dir held */
+static void
+lzfs_rdplus_instantiate(struct dentry *parent, lzfs_rdplus_t *rp)
+{
+	vnode_t *dvp = LZFS_ITOV(parent->d_inode);
+	const struct cred *cred = get_current_cred();
+	struct dentry *dentry, *alias;
+	struct inode *inode;
+	struct qstr q;
+	char *name = rp->rp_names;
+	vnode_t *vp;
+	vattr_t vap;
+	int i;
+
+	for (i = 0; i < rp->rp_count; i++, name += q.len + 1) {
+		q.name = name;
+		q.len  = strlen(name);
+		q.hash = full_name_hash(name, q.len);
+
+		if ((dentry = d_lookup(parent, &q)) != NULL) {
+			dput(dentry);
+			continue;
+		}
+		if (zfs_lookup(dvp, name, &vp, NULL, 0, NULL,
+				(struct cred *)cred, NULL, NULL, NULL))
+			continue;
+		inode = LZFS_VTOI(vp);
+		if (!test_bit(LZFS_VN_ATTR_VALID, &LZFS_ITOLZ(inode)->lz_flags))
+			(void) lzfs_attr_fetch(inode, &vap, cred);
+
+		if ((dentry = d_alloc(parent, &q)) == NULL) {
+			iput(inode);
+			break;
+		}
+		/* as lookup does, a directory may have a disconnected alias */
+		alias = d_splice_alias(inode, dentry);
+		if (alias && !IS_ERR(alias))
+			dput(alias);
+		dput(dentry);
+	}
+	put_cred(cred);
+	rp->rp_used  = 0;
+	rp->rp_count = 0;
+}
+
+/* From the cached listing of a dircache mount, or else from ZFS */
+static int
+lzfs_readdir_fill(struct inode *inode, void *dirent, filldir_t filldir,
+		loff_t *ppos)
+{
+	int eof;
+
+	if (lzfs_dircache_read(inode, dirent, filldir, ppos))
+		return 0;
+	return zfs_readdir(LZFS_ITOV(inode), dirent, NULL, &eof, NULL, 0,
+			filldir, ppos);
+}
+
 /* Read the directory. It uses the filldir function provided by Linux kernel.
  * 
  */
@@ -133,14 +346,32 @@ lzfs_vnop_create(struct inode *dir, struct dentry *dentry, int mode,
 int
 lzfs_vnop_readdir(struct file *filp, void *dirent, filldir_t filldir)
 {
-	vnode_t *vp;
-	int eof, err;
-	struct inode *inode = filp->f_path.dentry->d_inode;
+	int err;
+	struct dentry *parent = filp->f_path.dentry;
+	struct inode *inode = parent->d_inode;
+	lzfs_rdplus_t rp;
 
 	ENTRY;
-	vp = LZFS_ITOV(inode);
-	err = zfs_readdir(vp, dirent, NULL, &eof, NULL, 0, filldir, 
-			&filp->f_pos);
+	if (!(LZFS_SBTOLV(inode->i_sb)->lv_flags & LZFS_MNT_READDIRPLUS) ||
+	    (rp.rp_names = (char *)__get_free_page(GFP_KERNEL)) == NULL) {
+		err = lzfs_readdir_fill(inode, dirent, filldir, &filp->f_pos);
+		goto out;
+	}
+
+	rp.rp_dirent   = dirent;
+	rp.rp_filldir  = filldir;
+	rp.rp_used     = 0;
+	rp.rp_count    = 0;
+	rp.rp_done     = 0;
+	do {
+		rp.rp_stopped = 0;
+		err = lzfs_readdir_fill(inode, &rp, lzfs_rdplus_filldir,
+				&filp->f_pos);
+		lzfs_rdplus_instantiate(parent, &rp);
+	} while (!err && rp.rp_stopped && !rp.rp_done);
+	free_page((unsigned long)rp.rp_names);
+out:
+	lzfs_attr_accessed(inode);
 	tsd_exit();
 	EXIT;
 	if (err)
@@ -149,6 +380,12 @@ lzfs_vnop_readdir(struct file *filp, void *dirent, filldir_t filldir)
 }
 
 
+/*
+ * The VFS holds i_mutex of dir across lookup, as it does across readdir 
+ * and the namespace operations; this kernel has no shared directory lock 
+ * for lookups and readdir to run in parallel. lzfs takes no directory lock
+ * of its own, the ZAP is locked by ZFS.
+ */
 static struct dentry *
 lzfs_vnop_lookup(struct inode * dir, struct dentry *dentry,
 		 struct nameidata *nd)
@@ -156,13 +393,14 @@ lzfs_vnop_lookup(struct inode * dir, struct dentry *dentry,
 	vnode_t *vp;
 	vnode_t *dvp;
 	int err;
-	const struct cred *cred = get_current_cred();
+	const struct cred *cred;
 
 	ENTRY;
 	err = checkname((char *)dentry->d_name.name);
 	if(err)
 		return ((void * )-ENAMETOOLONG);
 	dvp = LZFS_ITOV(dir);
+	cred = get_current_cred();
 
 	err = zfs_lookup(dvp, (char *)dentry->d_name.name, &vp, NULL, 0 , NULL, 
 			(struct cred *) cred, NULL, NULL, NULL);
@@ -217,6 +455,9 @@ lzfs_vnop_link (struct dentry *old_dentry, struct inode * dir,
 	atomic_inc(&inode->i_count);
 
 	err = zfs_link(tdvp, svp, name, (struct cred *)cred, NULL, 0);
+	lzfs_attr_invalidate(dir);
+	lzfs_attr_invalidate(inode);
+	lzfs_dircache_drop(dir);
 	put_cred(cred);
 	if (err) {
 
@@ -249,6 +490,9 @@ lzfs_vnop_unlink(struct inode *dir, struct dentry *dentry)
 	dvp = LZFS_ITOV(dir);
 	err = zfs_remove(dvp, (char *)dentry->d_name.name, 
 			(struct cred *)cred, NULL, 0);
+	lzfs_attr_invalidate(dir);
+	lzfs_attr_invalidate(dentry->d_inode);
+	lzfs_dircache_drop(dir);
 	put_cred(cred);
 	tsd_exit();
 	EXIT;
@@ -289,6 +533,8 @@ lzfs_vnop_symlink (struct inode *dir, struct dentry *dentry,
 
 	err = zfs_symlink(dvp, (char *)dentry->d_name.name, vap, 
 			(char *)symname, (struct cred *)cred , NULL, 0, &vp);
+	lzfs_attr_invalidate(dir);
+	lzfs_dircache_drop(dir);
 	kfree(vap);
 	put_cred(cred);
 	if (err) {
@@ -327,6 +573,8 @@ lzfs_vnop_mkdir(struct inode *dir, struct dentry *dentry, int mode)
 	dvp = LZFS_ITOV(dir);
 	err = zfs_mkdir(dvp, (char *)dentry->d_name.name, vap,
 			&vp, (struct cred *) cred, NULL, 0, NULL);
+	lzfs_attr_invalidate(dir);
+	lzfs_dircache_drop(dir);
 	kfree(vap);
 	put_cred(cred);	
 	if (err) {
@@ -351,6 +599,9 @@ lzfs_vnop_rmdir(struct inode * dir, struct dentry *dentry)
     dvp = LZFS_ITOV(dir);
     err = zfs_rmdir(dvp, (char *)dentry->d_name.name, NULL, 
             (struct cred *) cred, NULL, 0);
+    lzfs_attr_invalidate(dir);
+    lzfs_attr_invalidate(dentry->d_inode);
+    lzfs_dircache_drop(dir);
     put_cred(cred);
 	tsd_exit();
     EXIT;
@@ -398,6 +649,8 @@ lzfs_vnop_mknod(struct inode * dir, struct dentry *dentry, int mode,
 
 	err = zfs_create(dvp, (char *)dentry->d_name.name, vap, 0, mode, 
 			 &vp, (struct cred *)cred, 0, NULL, NULL);
+	lzfs_attr_invalidate(dir);
+	lzfs_dircache_drop(dir);
 	put_cred(cred);
 	kfree(vap);
 	if (err) {
@@ -424,6 +677,18 @@ lzfs_vnop_rename (struct inode * old_dir, struct dentry * old_dentry,
 	err = zfs_rename(sdvp, (char *)old_dentry->d_name.name, tdvp, 
 			(char *) new_dentry->d_name.name, (struct cred *)cred, 
 			NULL, 0);	
+	lzfs_attr_invalidate(old_dir);
+	lzfs_attr_invalidate(new_dir);
+	lzfs_attr_invalidate(old_dentry->d_inode);
+	if (new_dentry->d_inode)
+		lzfs_attr_invalidate(new_dentry->d_inode);
+	lzfs_dircache_drop(old_dir);
+	lzfs_dircache_drop(new_dir);
+	/* the .. of a directory moved to another one, whose i_mutex is not
+	 * ours to take here, its next readdir drops the listing */
+	if (old_dir != new_dir && S_ISDIR(old_dentry->d_inode->i_mode))
+		set_bit(LZFS_VN_DIRCACHE_STALE, 
+			&LZFS_ITOLZ(old_dentry->d_inode)->lz_flags);
 	put_cred(cred);
 	tsd_exit();
 	EXIT;
@@ -447,6 +712,9 @@ lzfs_vnop_setattr(struct dentry *dentry, struct iattr *iattr)
 	if(err)
 	    return err;
 
+	lzfs_free_wait(inode);
+	lzfs_wb_flush(inode);
+
 	vap = kmalloc(sizeof(vattr_t), GFP_KERNEL);
 	ASSERT(vap != NULL);
 
@@ -481,12 +749,16 @@ lzfs_vnop_setattr(struct dentry *dentry, struct iattr *iattr)
 	}
 
 	if (mask & ATTR_SIZE) {
-		/* truncate the inode, znode */
-		vap->va_mask |= AT_SIZE;
-		vap->va_size = iattr->ia_size;
-
-		err = vmtruncate(inode, iattr->ia_size);
-		if (err) {
+		/* on an asyncfree mount a large cut is freed in background */
+		err = lzfs_free_truncate(inode, iattr->ia_size);
+		if (!err) {
+			/* truncate the inode, znode */
+			vap->va_mask |= AT_SIZE;
+			vap->va_size = iattr->ia_size;
+
+			err = vmtruncate(inode, iattr->ia_size);
+		}
+		if (err < 0) {
 			kfree(vap);
 			put_cred(cred);
 			tsd_exit();
@@ -496,6 +768,9 @@ lzfs_vnop_setattr(struct dentry *dentry, struct iattr *iattr)
 	}
 
 	err = zfs_setattr(vp, vap, 0, (struct cred *)cred, NULL);
+	lzfs_attr_invalidate(inode);
+	if (!err && (mask & ATTR_SIZE))
+		lzfs_mark_data_dirty(vp);
 	kfree(vap);
 	put_cred(cred);
 	tsd_exit();
@@ -551,6 +826,7 @@ static void *lzfs_follow_link(struct dentry *dentry, struct nameidata *nd)
 	uio.uio_segflg = UIO_SYSSPACE;
 
 	err = zfs_readlink(vp, &uio, (struct cred *)cred, NULL);
+	lzfs_attr_accessed(inode);
 	if (err) {
 		kfree(buf);
 		buf = ERR_PTR(-err);
@@ -593,443 +869,2236 @@ lzfs_vnop_readlink(struct dentry *dentry, char __user *buf, int len)
 	return ((int) (len - uio.uio_resid));
 }
 #endif
+/*
+ * Group commit: fsyncs that arrive on a mount while a ZIL commit is 
+ * running join the next one, which is then made by one of them for all.
+ * A commit with a single request behind it is the file's own zfs_fsync, 
+ * one with several commits the whole log of the mount with zfs_sync, 
+ * which is no more expensive than the first of the per file commits it
+ * replaces.
+ *
+ * Writes and size changes mark the vnode once they are logged, and a
+ * vnode starts out marked, as the log may still hold writes from an
+ * earlier life of the inode. The mark is cleared when a request joins a
+ * commit, which is recorded in lz_sync_gen, so that a write logged 
+ * meanwhile sets it again. An fdatasync that finds the mark clear has 
+ * only metadata (times, mode, ownership) to commit, which it need not
+ * wait for, but it does wait for the commit of the last clear when that
+ * has not completed.
+ *
+ * Every request of a commit takes its result from lv_sync_error, and a
+ * request whose commit failed marks its vnode again. The next commit 
+ * does not start before they all have, which keeps lv_sync_error that of
+ * lv_sync_done, and a clear mark with the commit of lz_sync_gen done
+ * means that commit succeeded.
+ */
+static int
+lzfs_sync_commit(vnode_t *vp, int datasync, cred_t *cred)
+{
+	lzfs_vfs_t *lvp = LZFS_SBTOLV(LZFS_VTOI(vp)->i_sb);
+	lzfs_vnode_t *lz = LZFS_VTOLZ(vp);
+	uint64_t gen;
+	int joined, err;
+
+	mutex_enter(&lvp->lv_sync_lock);
+	if (test_and_clear_bit(LZFS_VN_DATA_DIRTY, &lz->lz_flags) || 
+	    !datasync)
+		lz->lz_sync_gen = lvp->lv_sync_gen;
+	gen = lz->lz_sync_gen;
+
+	if (gen == lvp->lv_sync_gen) {
+		lvp->lv_sync_joined++;
+	} else if (lvp->lv_sync_done < gen || 
+	    (lvp->lv_sync_done == gen && lvp->lv_sync_waiters)) {
+		/* the commit is running or its result not yet taken */
+		lvp->lv_sync_waiters++;
+	} else {
+		mutex_exit(&lvp->lv_sync_lock);
+		return 0;
+	}
+
+	while (lvp->lv_sync_done < gen) {
+		if (lvp->lv_sync_busy || lvp->lv_sync_waiters) {
+			cv_wait(&lvp->lv_sync_cv, &lvp->lv_sync_lock);
+			continue;
+		}
+
+		/* all earlier commits are done, lead this one */
+		ASSERT(lvp->lv_sync_gen == gen);
+		joined = lvp->lv_sync_joined;
+		lvp->lv_sync_joined = 0;
+		lvp->lv_sync_waiters = joined;
+		lvp->lv_sync_gen++;
+		lvp->lv_sync_busy = 1;
+		mutex_exit(&lvp->lv_sync_lock);
+
+		if (joined == 1)
+			err = zfs_fsync(vp, datasync, cred, NULL);
+		else
+			err = zfs_sync(&lvp->lv_vfs, 0, cred);
+
+		mutex_enter(&lvp->lv_sync_lock);
+		lvp->lv_sync_busy = 0;
+		lvp->lv_sync_error = err;
+		lvp->lv_sync_done = gen;
+		cv_broadcast(&lvp->lv_sync_cv);
+	}
+
+	ASSERT(lvp->lv_sync_done == gen);
+	err = lvp->lv_sync_error;
+	if (err)
+		set_bit(LZFS_VN_DATA_DIRTY, &lz->lz_flags);
+	if (--lvp->lv_sync_waiters == 0)
+		cv_broadcast(&lvp->lv_sync_cv);
+	mutex_exit(&lvp->lv_sync_lock);
+	return err;
+}
+
 int lzfs_vnop_fsync(struct file *filep, struct dentry *dentry, int datasync)
 {       
-	int err = 0;
+	int err = 0, ferr;
 	vnode_t *vp = NULL;
+	struct inode *inode = filep->f_path.dentry->d_inode;
 	const struct cred *cred = get_current_cred();
 
 	ENTRY;
 
-	vp = LZFS_ITOV(filep->f_path.dentry->d_inode); 
-	err = zfs_fsync(vp, datasync, (struct cred *)cred, NULL);
+	vp = LZFS_ITOV(inode); 
+	ferr = lzfs_free_error(inode);
+	err = lzfs_wb_sync(inode);
+	if (!err)
+		err = ferr;
+	if (!err)
+		err = -lzfs_sync_commit(vp, datasync, (cred_t *)cred);
 
 	put_cred(cred);
+	tsd_exit();
 	EXIT;
 	return err;
 }
 
-int copy_data(read_descriptor_t *desc, struct page *page, 
-		unsigned long offset, unsigned long size)
+/*
+ * zfs_read and zfs_write advance the iovecs they are handed, so they get a
+ * private copy of the caller's array (for aio that is the kiocb's array).
+ * Returns the copy, which is fast unless nr_segs exceeds UIO_FASTIOV, or 
+ * NULL on allocation failure.
+ */
+static struct iovec *
+lzfs_uio_init(uio_t *uio, struct iovec *fast, const struct iovec *iov,
+		unsigned long nr_segs, loff_t pos, uio_seg_t segment)
 {
-	char *kaddr;
-	unsigned long left, count = desc->count;
-
-	if (size > count)
-		size = count;
-
-	kaddr = kmap(page);
-	left  = copy_to_user(desc->arg.buf, kaddr + offset, size);
-	kunmap(page);
+	struct iovec *uiov = fast;
+	ssize_t len = 0;
+	unsigned long i;
+
+	if (nr_segs > UIO_FASTIOV) {
+		uiov = kmalloc(nr_segs * sizeof(struct iovec), GFP_KERNEL);
+		if (uiov == NULL)
+			return NULL;
+	}
 
-	if (left) {
-		size -= left;
-		desc->error = -EFAULT;
+	for (i = 0; i < nr_segs; i++) {
+		uiov[i] = iov[i];
+		len    += iov[i].iov_len;
 	}
 
-	desc->count    = count - size;
-	desc->written += size;
-	desc->arg.buf += size;
-	return size;
+	bzero(uio, sizeof(uio_t));
+	uio->uio_iov     = uiov;
+	uio->uio_iovcnt  = nr_segs;
+	uio->uio_loffset = (offset_t)(pos);
+	uio->uio_resid   = len;
+	uio->uio_limit   = MAXOFFSET_T;
+	uio->uio_segflg  = segment;
+	return uiov;
 }
 
-ssize_t
-lzfs_vnop_read (struct file *filep, char __user *buf, size_t len, loff_t *ppos)
+/*
+ * Reads into the whole iovec array with a single zfs_read, bypassing the 
+ * page cache. Returns the number of bytes read or a negative errno.
+ */
+static ssize_t 
+lzfs_readv(vnode_t *vp, const struct iovec *iov, unsigned long nr_segs,
+		loff_t *ppos, uio_seg_t segment)
 {
-	struct iovec iov = { .iov_base = buf, .iov_len = len };
-	int err;
 	const cred_t *cred = get_current_cred();
-	vnode_t *vp = NULL;
+	struct iovec fast[UIO_FASTIOV], *uiov;
+	ssize_t len;
 	uio_t uio;
-	loff_t isize;
-	ssize_t size;
+	int err;
 
-	/* PAGE CACHE SUPPORT VARIABLES */
-	struct address_space *mapping = filep->f_mapping;
-	struct inode *inode = mapping->host;
-	struct file_ra_state *ra = &filep->f_ra;
-	pgoff_t index;
-	pgoff_t last_index;
-	pgoff_t prev_index;
-	unsigned long offset;      /* offset into pagecache page */
-	unsigned int prev_offset;
-	read_descriptor_t desc;
+	uiov = lzfs_uio_init(&uio, fast, iov, nr_segs, *ppos, segment);
+	if (uiov == NULL) {
+		put_cred(cred);
+		return -ENOMEM;
+	}
 
-	vp  = LZFS_ITOV(inode);
+	len = uio.uio_resid;
+	err = zfs_read(vp, &uio, 0, (cred_t *)cred, NULL);
+	lzfs_attr_accessed(LZFS_VTOI(vp));
+	if (uiov != fast)
+		kfree(uiov);
+	put_cred(cred);
+	if (err)
+		return -err;
 
-	desc.written = 0;
-	desc.arg.buf = buf;
-	desc.count   = len;
-	desc.error   = 0;
+	len -= uio.uio_resid;
+	*ppos += len;
+	return len;
+}
 
-	ENTRY;
+/*
+ * Writes the whole iovec array with a single zfs_write. Returns the number
+ * of bytes written or a negative errno, *ppos is moved past the data, 
+ * which for FAPPEND is wherever zfs_write placed it.
+ */
+static ssize_t 
+lzfs_writev(vnode_t *vp, unsigned int file_flags, const struct iovec *iov,
+		unsigned long nr_segs, loff_t *ppos, uio_seg_t segment)
+{
+	const cred_t *cred = get_current_cred();
+	struct iovec fast[UIO_FASTIOV], *uiov;
+	ssize_t len;
+	uio_t uio;
+	int err;
 
-	index = *ppos >> PAGE_CACHE_SHIFT;
-	prev_index = ra->prev_pos >> PAGE_CACHE_SHIFT;
-	prev_offset = ra->prev_pos & (PAGE_CACHE_SIZE - 1);
-	last_index = (*ppos + len + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
-	offset = *ppos & ~PAGE_CACHE_MASK;
+	uiov = lzfs_uio_init(&uio, fast, iov, nr_segs, *ppos, segment);
+	if (uiov == NULL) {
+		put_cred(cred);
+		return -ENOMEM;
+	}
 
-	while (1) {
-		struct page *page;
-		pgoff_t end_index;
-		unsigned long nr, ret;
+	len = uio.uio_resid;
+	err = zfs_write(vp, &uio, file_flags, (cred_t *)cred, NULL);
+	if (uiov != fast)
+		kfree(uiov);
+	put_cred(cred);
+	if (err)
+		return -err;
 
-#if 0
-		printk(KERN_INFO "desc.count=%ld, len=%ld, offset=%ld, pos=%lld\n", 
-				desc.count, len, offset, *ppos);
-#endif
+	if (uio.uio_resid < len)
+		lzfs_mark_data_dirty(vp);
 
-		if (!desc.count)
-			break;
+	*ppos = uio.uio_loffset;
+	return len - uio.uio_resid;
+}
 
-		BUG_ON(desc.written > len);
+/*
+ * Write-behind (mount option writebehind): small write()s to a file that is
+ * neither mapped nor cached are gathered in a per vnode buffer of up to a 
+ * record and reach ZFS as one zfs_write, and so one transaction, instead 
+ * of one per call. Adjacent writes extend the buffer, anything else writes
+ * it out first. The buffer is written out before whatever has to observe 
+ * the data or the file size: reads, fsync, close, mmap, stat, seeks, 
+ * truncate, fiemap and fallocate, while the other write paths hold 
+ * lz_wb_lock across their own write. Writeback reaches buffered files 
+ * through write_inode, memory pressure through lzfs_wb_shrinker.
+ */
+#define LZFS_WB_MAX	(128 * 1024)
 
-		cond_resched();
-		page = find_get_page(mapping, index);
-		if (!page) {
-			/* NORMAL CASE: DATA IS NOT CACHED */
-			goto no_cached_page;
-		}
+static LIST_HEAD(lzfs_wb_list);			/* vnodes with buffered data */
+static DEFINE_SPINLOCK(lzfs_wb_list_lock);
+static unsigned long lzfs_wb_bytes = 0;		/* under lzfs_wb_list_lock */
+static unsigned long lzfs_wb_reclaiming = 0;
+static taskq_t *lzfs_wb_taskq = NULL;
 
-		/* MMAPED DATA: DATA IS CACHED */
-		if (!PageUptodate(page)) {
-			/* WE ARE USING PAGE CACHE ONLY FOR MMAP, ONCE WE GET 
-			 * LOCKED PAGE IT HAS TO BE UPTODATE */
+static void lzfs_update_cached_pages(struct address_space *mapping, 
+		loff_t pos, const char *buf, size_t len);
 
-			lock_page(page);
+void
+lzfs_wb_init(lzfs_vnode_t *lz)
+{
+	mutex_init(&lz->lz_wb_lock, NULL, MUTEX_DEFAULT, NULL);
+	lz->lz_wb_buf   = NULL;
+	lz->lz_wb_len   = 0;
+	lz->lz_wb_error = 0;
+	INIT_LIST_HEAD(&lz->lz_wb_node);
+}
 
-			if (!page->mapping) {
-				/* truncate happened */
-				unlock_page(page);
-				page_cache_release(page);
-				continue;
-			}
+static inline int
+lzfs_wb_enabled(struct inode *inode)
+{
+	return LZFS_SBTOLV(inode->i_sb)->lv_flags & LZFS_MNT_WRITEBEHIND;
+}
 
-			if (!PageUptodate(page)) {
-				unlock_page(page);
-				BUG();
-			}
-			unlock_page(page);
-		}
-		isize = i_size_read(inode);
-		end_index = (isize - 1) >> PAGE_CACHE_SHIFT;
-		if (unlikely(!isize || index > end_index)) {
-			page_cache_release(page);
-			goto out;
-		}
-		/* nr is the maximum number of bytes to copy from this page */
-		nr = PAGE_CACHE_SIZE;
-		if (index == end_index) {
-			nr = ((isize - 1) & ~PAGE_CACHE_MASK) + 1;
-			if (nr <= offset) {
-				page_cache_release(page);
-				goto out;
-			}
-		}
-		nr = nr - offset;
-		mark_page_accessed(page);
-		prev_index = index;
+static inline size_t
+lzfs_wb_size(struct inode *inode)
+{
+	return min_t(size_t, inode->i_sb->s_blocksize, LZFS_WB_MAX);
+}
 
-		ret = copy_data(&desc, page, offset, nr);
-		*ppos += ret;
-		offset += ret;
-		index  += (offset >> PAGE_CACHE_SHIFT);
-		offset &= ~PAGE_CACHE_MASK;
-		prev_offset = offset;
+/* Empties the buffer without writing it, lz_wb_lock held */
+static void
+lzfs_wb_drop(lzfs_vnode_t *lz)
+{
+	spin_lock(&lzfs_wb_list_lock);
+	lzfs_wb_bytes -= lz->lz_wb_len;
+	list_del_init(&lz->lz_wb_node);
+	spin_unlock(&lzfs_wb_list_lock);
+	lz->lz_wb_len = 0;
+}
 
-		page_cache_release(page);
+/*
+ * Writes the buffer to ZFS and frees it, lz_wb_lock held. A failure is 
+ * also kept in lz_wb_error for fsync and close to report, the data is 
+ * dropped either way. Returns 0 or a negative errno.
+ */
+static int
+lzfs_wb_write_out(struct inode *inode)
+{
+	lzfs_vnode_t *lz = LZFS_ITOLZ(inode);
+	struct iovec iov;
+	loff_t pos;
+	ssize_t ret;
 
-#if 0
-		printk(KERN_ERR "%s: isize=%lld nr=%ld len=%ld offset=%ld desc.written=%ld desc.count=%ld pos=%lld.\n", 
-				__FUNCTION__, isize, nr, len, offset, desc.written, desc.count, *ppos);
-#endif
+	if (!lz->lz_wb_len) {
+		kfree(lz->lz_wb_buf);
+		lz->lz_wb_buf = NULL;
+		return 0;
+	}
 
-		if (*ppos >= isize) {
-			ra->prev_pos = prev_index;
-			ra->prev_pos <<= PAGE_CACHE_SHIFT;
-			ra->prev_pos |= prev_offset;
-			goto out;
-		}
+	iov.iov_base = lz->lz_wb_buf;
+	iov.iov_len  = lz->lz_wb_len;
+	pos = lz->lz_wb_off;
+	ret = lzfs_writev(LZFS_ITOV(inode), 0, &iov, 1, &pos, UIO_SYSSPACE);
+	if (ret > 0 && inode->i_mapping->nrpages)
+		lzfs_update_cached_pages(inode->i_mapping, lz->lz_wb_off, 
+				lz->lz_wb_buf, ret);
+	if (ret >= 0 && ret < lz->lz_wb_len)
+		ret = -ENOSPC;
+	if (ret < 0)
+		lz->lz_wb_error = -ret;
+
+	lzfs_wb_drop(lz);
+	kfree(lz->lz_wb_buf);
+	lz->lz_wb_buf = NULL;
+	return (ret < 0) ? ret : 0;
+}
 
-		if (ret == nr && desc.count)
-			continue;
+/*
+ * Takes a write() into the buffer, lz_wb_lock held. Returns the bytes 
+ * taken, 0 when the caller has to write to ZFS itself (the buffer is then
+ * empty), or a negative errno.
+ */
+static ssize_t
+lzfs_wb_write(struct inode *inode, unsigned int file_flags, 
+		const char __user *buf, size_t len, loff_t *ppos)
+{
+	lzfs_vnode_t *lz = LZFS_ITOLZ(inode);
+	size_t size = lzfs_wb_size(inode);
+	loff_t pos = *ppos;
+	int err;
 
-		goto out;
-no_cached_page:
-		isize = i_size_read(inode);
-		if (*ppos >= isize)
-			break;
-		
-		size = PAGE_CACHE_SIZE;
-		if (desc.written + size > len)
-			size = len - desc.written;
+	if (file_flags & FAPPEND) {
+		/* end of file is wherever the buffer ends */
+		pos = lz->lz_wb_len ? lz->lz_wb_off + lz->lz_wb_len : 
+			i_size_read(inode);
+	}
 
-		if (offset + size > isize)
-			size = isize - desc.written;
+	if (len >= size || (lz->lz_wb_len && 
+	    (pos != lz->lz_wb_off + lz->lz_wb_len || 
+	     lz->lz_wb_len + len > size))) {
+		if ((err = lzfs_wb_write_out(inode)))
+			return err;
+		if (len >= size)
+			return 0;
+	}
 
+	if (lz->lz_wb_buf == NULL) {
+		lz->lz_wb_buf = kmalloc(size, GFP_KERNEL | __GFP_NOWARN);
+		if (lz->lz_wb_buf == NULL)
+			return 0;
+	}
 
-		iov.iov_base = desc.arg.buf;
-		iov.iov_len  = size;
+	if (copy_from_user(lz->lz_wb_buf + lz->lz_wb_len, buf, len))
+		return -EFAULT;
 
-		uio.uio_iov     = &iov;
-		uio.uio_iovcnt  = 1;
-		uio.uio_loffset = (offset_t) *ppos;
-		uio.uio_resid   = size;
-		uio.uio_segflg  = UIO_USERSPACE;
-		err = zfs_read(vp, &uio, 0,(cred_t *) cred, NULL);
-		if (unlikely(err)) {
-			err = -err;
-			goto out_error;
+	spin_lock(&lzfs_wb_list_lock);
+	if (!lz->lz_wb_len) {
+		lz->lz_wb_off = pos;
+		list_add_tail(&lz->lz_wb_node, &lzfs_wb_list);
+	}
+	lzfs_wb_bytes += len;
+	spin_unlock(&lzfs_wb_list_lock);
+
+	if (!lz->lz_wb_len)
+		mark_inode_dirty(inode);
+	lz->lz_wb_len += len;
+	*ppos = pos + len;
+	return len;
+}
+
+/*
+ * Writes out the buffer, returns 0 or a negative errno. Writers that do 
+ * not go through the buffer call this first, and then write without 
+ * lz_wb_lock: a write buffered meanwhile is concurrent with theirs. So
+ * is one buffered while lz_wb_buf is tested unlocked, which keeps reads 
+ * and getattr of files with nothing buffered off lz_wb_lock; the buffer
+ * is freed whenever it is written out.
+ */
+static int
+lzfs_wb_flush(struct inode *inode)
+{
+	lzfs_vnode_t *lz = LZFS_ITOLZ(inode);
+	int err;
+
+	if (!ACCESS_ONCE(lz->lz_wb_buf))
+		return 0;
+
+	mutex_enter(&lz->lz_wb_lock);
+	err = lzfs_wb_write_out(inode);
+	mutex_exit(&lz->lz_wb_lock);
+	return err;
+}
+
+/* 
+ * lzfs_wb_flush for fsync and close, which also report (and clear) the 
+ * failure of an earlier write out.
+ */
+static int
+lzfs_wb_sync(struct inode *inode)
+{
+	lzfs_vnode_t *lz = LZFS_ITOLZ(inode);
+	int err;
+
+	if (!ACCESS_ONCE(lz->lz_wb_buf) && !ACCESS_ONCE(lz->lz_wb_error))
+		return 0;
+
+	mutex_enter(&lz->lz_wb_lock);
+	lzfs_wb_write_out(inode);
+	err = lz->lz_wb_error;
+	lz->lz_wb_error = 0;
+	mutex_exit(&lz->lz_wb_lock);
+	return -err;
+}
+
+/* Writes out the buffer and frees it, for write_inode, clear_inode and reclaim */
+void
+lzfs_wb_release(struct inode *inode)
+{
+	lzfs_vnode_t *lz = LZFS_ITOLZ(inode);
+
+	mutex_enter(&lz->lz_wb_lock);
+	lzfs_wb_write_out(inode);
+	mutex_exit(&lz->lz_wb_lock);
+}
+
+/* The file is being deleted, drops the buffered data */
+void
+lzfs_wb_discard(struct inode *inode)
+{
+	lzfs_vnode_t *lz = LZFS_ITOLZ(inode);
+
+	mutex_enter(&lz->lz_wb_lock);
+	lzfs_wb_drop(lz);
+	kfree(lz->lz_wb_buf);
+	lz->lz_wb_buf = NULL;
+	mutex_exit(&lz->lz_wb_lock);
+}
+
+/*
+ * Under memory pressure the buffers are written out and freed by the 
+ * lzfs_wb taskq, the shrinker itself may run where zfs_write cannot.
+ */
+static void
+lzfs_wb_reclaim(void *arg)
+{
+	lzfs_vnode_t *lz;
+	struct inode *inode;
+	LIST_HEAD(todo);
+
+	spin_lock(&lzfs_wb_list_lock);
+	list_splice_init(&lzfs_wb_list, &todo);
+	while (!list_empty(&todo)) {
+		lz = list_entry(todo.next, lzfs_vnode_t, lz_wb_node);
+		list_move_tail(&lz->lz_wb_node, &lzfs_wb_list);
+		/* an inode being evicted is written out by clear_inode */
+		inode = igrab(LZFS_VTOI(&lz->lz_vnode));
+		spin_unlock(&lzfs_wb_list_lock);
+		if (inode) {
+			lzfs_wb_release(inode);
+			iput(inode);
 		}
+		spin_lock(&lzfs_wb_list_lock);
+	}
+	spin_unlock(&lzfs_wb_list_lock);
+	clear_bit(0, &lzfs_wb_reclaiming);
+}
 
-		ret = size - uio.uio_resid;
-		desc.count    = desc.count - ret;
-		desc.written += ret;
-		desc.arg.buf += ret;
-		BUG_ON(desc.count < 0);
+static int
+lzfs_wb_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	if (nr_to_scan && lzfs_wb_bytes && 
+	    !test_and_set_bit(0, &lzfs_wb_reclaiming)) {
+		if (!taskq_dispatch(lzfs_wb_taskq, lzfs_wb_reclaim, NULL, 
+				TQ_NOSLEEP))
+			clear_bit(0, &lzfs_wb_reclaiming);
+	}
+	return lzfs_wb_bytes >> PAGE_SHIFT;
+}
 
-		*ppos += ret;
-		index  += (offset >> PAGE_CACHE_SHIFT);
-		offset = *ppos & ~PAGE_CACHE_MASK;
-		prev_offset = offset;
+static struct shrinker lzfs_wb_shrinker = {
+	.shrink	= lzfs_wb_shrink,
+	.seeks	= DEFAULT_SEEKS,
+};
 
-#if 0
-		printk(KERN_ERR "%s: isize=%lld size=%ld len=%ld offset=%ld written=%ld pos=%lld.\n", 
-				__FUNCTION__, isize, size, len, offset, desc.written, *ppos);
-#endif
+/*
+ * Byte range locks of the read and write paths. A write holds the bytes 
+ * it writes from the write back of their dirty pages, through zfs_write 
+ * or the copy into cached pages, to the invalidation of their cached 
+ * copies; a read holds the bytes it reads below i_size as it was when it
+ * took the lock (lzfs_rl_read_len). A read thus sees a write within that
+ * range whole or not at all, though not one that extends the file past 
+ * it meanwhile. Cached pages are only ever dropped for the range written,
+ * and I/O to disjoint ranges of a file runs in parallel.
+ *
+ * Lock order is range lock, lz_wb_lock, page lock: O_APPEND writers write
+ * out the buffer or append to it under their range lock, the buffer is 
+ * copied into cached pages as it is written out. Page faults, readahead 
+ * and writeback work on locked pages and take neither of the others.
+ */
+typedef struct lzfs_rl {
+	struct list_head	rl_node;	/* on lz_rl_list */
+	loff_t			rl_start;
+	loff_t			rl_end;		/* first byte past the range */
+	int			rl_write;
+} lzfs_rl_t;
+
+/* Adds rl to the held locks unless one of them conflicts */
+static int
+lzfs_rl_try(lzfs_vnode_t *lz, lzfs_rl_t *rl)
+{
+	lzfs_rl_t *held;
+
+	spin_lock(&lz->lz_rl_lock);
+	list_for_each_entry(held, &lz->lz_rl_list, rl_node) {
+		if ((rl->rl_write || held->rl_write) && 
+		    held->rl_start < rl->rl_end && rl->rl_start < held->rl_end) {
+			spin_unlock(&lz->lz_rl_lock);
+			return 0;
+		}
+	}
+	list_add_tail(&rl->rl_node, &lz->lz_rl_list);
+	spin_unlock(&lz->lz_rl_lock);
+	return 1;
+}
 
-		if (!desc.count)
-			break; // goto out;
+static void
+lzfs_rl_enter(struct inode *inode, lzfs_rl_t *rl, loff_t start, size_t len,
+		int write)
+{
+	lzfs_vnode_t *lz = LZFS_ITOLZ(inode);
+
+	rl->rl_start = start;
+	rl->rl_end   = (len > LLONG_MAX - start) ? LLONG_MAX : start + len;
+	rl->rl_write = write;
+	wait_event(lz->lz_rl_wait, lzfs_rl_try(lz, rl));
+}
+
+/*
+ * Readers lock the part of their range below i_size only, a large read 
+ * does not hold off the writers past the end of the file.
+ */
+static inline size_t
+lzfs_rl_read_len(struct inode *inode, loff_t pos, size_t len)
+{
+	loff_t isize = i_size_read(inode);
+
+	if (pos >= isize)
+		return 0;
+	return min_t(loff_t, len, isize - pos);
+}
+
+static void
+lzfs_rl_exit(struct inode *inode, lzfs_rl_t *rl)
+{
+	lzfs_vnode_t *lz = LZFS_ITOLZ(inode);
+
+	spin_lock(&lz->lz_rl_lock);
+	list_del(&rl->rl_node);
+	spin_unlock(&lz->lz_rl_lock);
+	wake_up_all(&lz->lz_rl_wait);
+}
+
+/*
+ * O_APPEND writers take a write range lock from the end of the file on, 
+ * which serializes them with each other and with any write past the end,
+ * and write at i_size as it is once they hold it. A short or failed 
+ * append thus leaves no hole, the next one starts where it stopped. The
+ * file may have been truncated below the start of the lock meanwhile, 
+ * then the lock is taken again from the new end.
+ *
+ * Appenders do not copy in parallel into ranges reserved past the end:
+ * zfs_write moves the size of the znode as it logs each write, so one
+ * that completes above a reservation still being copied would publish
+ * the hole below it, to readers and to ZIL replay alike.
+ */
+static void
+lzfs_append_lock(struct inode *inode, lzfs_rl_t *rl)
+{
+	loff_t start;
+
+	for (;;) {
+		start = i_size_read(inode);
+		lzfs_rl_enter(inode, rl, start, LLONG_MAX, 1);
+		if (i_size_read(inode) >= start)
+			return;
+		lzfs_rl_exit(inode, rl);
+	}
+}
+
+/*
+ * The append lock for writers that go to ZFS or the page cache. Appends 
+ * buffered by write-behind end past i_size, they are written out first.
+ * Returns the offset to write at in *pos, or a negative errno without the
+ * lock.
+ */
+static int
+lzfs_append_begin(struct inode *inode, lzfs_rl_t *rl, loff_t *pos)
+{
+	int err;
+
+	lzfs_append_lock(inode, rl);
+	if ((err = lzfs_wb_flush(inode))) {
+		lzfs_rl_exit(inode, rl);
+		return err;
+	}
+	*pos = i_size_read(inode);
+	return 0;
+}
+
+/*
+ * Writes the user iovecs with a single zfs_write, past the page cache. 
+ * Dirty pages of the range are written back first and the cached copies 
+ * are dropped afterwards, so mappings fault in the new data. O_APPEND 
+ * writes go to the end of the file under lzfs_append_begin. Used for 
+ * O_DIRECT and for files that are not mapped.
+ */
+static ssize_t
+lzfs_writev_uncached(struct address_space *mapping, unsigned int file_flags,
+		const struct iovec *iov, unsigned long nr_segs, loff_t *ppos)
+{
+	vnode_t *vp = LZFS_ITOV(mapping->host);
+	size_t count = iov_length(iov, nr_segs);
+	loff_t pos = *ppos;
+	lzfs_rl_t rl;
+	ssize_t ret;
+
+	if (count == 0)
+		return 0;
+
+	if (file_flags & FAPPEND) {
+		if ((ret = lzfs_append_begin(mapping->host, &rl, &pos)))
+			return ret;
+	} else {
+		lzfs_rl_enter(mapping->host, &rl, pos, count, 1);
+	}
+
+	if (mapping->nrpages) {
+		ret = filemap_write_and_wait_range(mapping, pos, 
+				pos + count - 1);
+		if (ret)
+			goto out;
 	}
 
+	ret = lzfs_writev(vp, file_flags & ~FAPPEND, iov, nr_segs, &pos, 
+			UIO_USERSPACE);
+	if (ret > 0 && mapping->nrpages)
+		invalidate_inode_pages2_range(mapping, 
+			(pos - ret) >> PAGE_CACHE_SHIFT,
+			(pos - 1) >> PAGE_CACHE_SHIFT);
+	if (ret > 0) {
+		/* writers past the page cache are throttled with the rest */
+		balance_dirty_pages_ratelimited_nr(mapping, 
+			(ret + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT);
+	}
+	if (ret >= 0)
+		*ppos = pos;
 out:
-//	*ppos = ((loff_t)index << PAGE_CACHE_SHIFT) + offset;
+	lzfs_rl_exit(mapping->host, &rl);
+	return ret;
+}
 
-	zfs_file_accessed(vp);
-	put_cred(cred);
-	tsd_exit();
-	EXIT;
-	return ((ssize_t) (desc.written));
-out_error:
-	put_cred(cred);
+/*
+ * O_DIRECT: the user iovecs go straight to zfs_read/zfs_write, see 
+ * lzfs_writev_uncached. Reads write back the dirty pages of the range 
+ * first.
+ */
+static ssize_t
+lzfs_direct_rw(int rw, struct file *filep, const struct iovec *iov,
+		unsigned long nr_segs, loff_t *ppos)
+{
+	struct address_space *mapping = filep->f_mapping;
+	vnode_t *vp = LZFS_ITOV(mapping->host);
+	size_t count = iov_length(iov, nr_segs);
+	loff_t pos = *ppos;
+	lzfs_rl_t rl;
+	ssize_t ret;
+
+	ENTRY;
+	if (count == 0) {
+		EXIT;
+		return 0;
+	}
+
+	if (rw == WRITE) {
+		if ((ret = lzfs_wb_flush(mapping->host))) {
+			EXIT;
+			return ret;
+		}
+		ret = lzfs_writev_uncached(mapping, filep->f_flags, iov, 
+				nr_segs, ppos);
+		tsd_exit();
+		EXIT;
+		return ret;
+	}
+
+	ret = lzfs_wb_flush(mapping->host);
+	if (ret) {
+		EXIT;
+		return ret;
+	}
+
+	lzfs_rl_enter(mapping->host, &rl, pos, 
+			lzfs_rl_read_len(mapping->host, pos, count), 0);
+	if (mapping->nrpages)
+		ret = filemap_write_and_wait_range(mapping, pos, pos + count - 1);
+	if (!ret)
+		ret = lzfs_readv(vp, iov, nr_segs, &pos, UIO_USERSPACE);
+	lzfs_rl_exit(mapping->host, &rl);
+	if (ret >= 0) {
+		zfs_file_accessed(vp);
+		*ppos = pos;
+	}
 	tsd_exit();
 	EXIT;
-	return err;
+	return ret;
 }
 
-/* XXX --> Internal function used by lzfs_vnop_write and lzfs_writepage 
- *
- * Performs the write operation
- *
- * Explanation of parameters
- * 		file_flags = struct file *file->f_flags
- * 		buf        = buffer pointer to data
- * 		len        = length of the data
- * 		pos        = offest within file to wite
- * 		segment    = indicates whether buf pointer points to 
- * 		             user space buffer or kernel buffer.
- * */
-ssize_t lzfs_write(vnode_t *vp, unsigned int file_flags, 
-		const char *buf, ssize_t len, loff_t pos, uio_seg_t segment)
+int copy_data(read_descriptor_t *desc, struct page *page, 
+		unsigned long offset, unsigned long size)
 {
-	uio_t uio;
-	const cred_t *cred = get_current_cred();
-	struct iovec iov;
-	int err;
+	char *kaddr;
+	unsigned long left, count = desc->count;
 
-	iov.iov_base = (void *) buf;
-	iov.iov_len  = len;
+	if (size > count)
+		size = count;
 
-	uio.uio_iov     = &iov;
-	uio.uio_resid   = len;
-	uio.uio_iovcnt  = 1;
-	uio.uio_loffset = (offset_t)(pos);
-	uio.uio_limit   = MAXOFFSET_T;
-	uio.uio_segflg  = segment;
+	kaddr = kmap(page);
+	left  = copy_to_user(desc->arg.buf, kaddr + offset, size);
+	kunmap(page);
 
-	err = zfs_write(vp, &uio, file_flags, (cred_t *)cred, NULL);
-	put_cred(cred);
-	return err;
+	if (left) {
+		size -= left;
+		desc->error = -EFAULT;
+	}
+
+	desc->count    = count - size;
+	desc->written += size;
+	desc->arg.buf += size;
+	return size;
+}
+
+/*
+ * Returns the length of the next zfs_read issued by the uncached path of
+ * lzfs_vnop_read. The read covers as much of the request as possible with
+ * a single call: it is bounded by EOF, ends on a record boundary when more
+ * than one record is left (so that the following read starts aligned), and
+ * stops at the first page that mmap has brought into the page cache.
+ */
+static ssize_t
+lzfs_uncached_read_size(struct address_space *mapping, loff_t pos,
+		size_t count, loff_t isize)
+{
+	loff_t recsize = mapping->host->i_sb->s_blocksize;
+	loff_t end = pos + count;
+	struct pagevec pvec;
+	pgoff_t next;
+
+	if (end >= isize)
+		end = isize;
+	else if ((end & ~(recsize - 1)) > pos)
+		end &= ~(recsize - 1);
+
+	if (!mapping->nrpages)
+		return end - pos;
+
+	/* the page at pos is known not to be cached */
+	pagevec_init(&pvec, 0);
+	if (pagevec_lookup(&pvec, mapping, (pos >> PAGE_CACHE_SHIFT) + 1, 1)) {
+		next = pvec.pages[0]->index;
+		pagevec_release(&pvec);
+		if (((loff_t) next << PAGE_CACHE_SHIFT) < end)
+			end = (loff_t) next << PAGE_CACHE_SHIFT;
+	}
+	return end - pos;
+}
+
+/*
+ * Returns how much of a write at pos, whose first page is not cached, can
+ * go to ZFS in one call from the page cache aware path of lzfs_vnop_write: 
+ * up to the next cached page.
+ */
+static ssize_t
+lzfs_uncached_write_size(struct address_space *mapping, loff_t pos,
+		size_t count)
+{
+	loff_t end = pos + count;
+	struct pagevec pvec;
+	pgoff_t next;
+
+	pagevec_init(&pvec, 0);
+	if (pagevec_lookup(&pvec, mapping, (pos >> PAGE_CACHE_SHIFT) + 1, 1)) {
+		next = pvec.pages[0]->index;
+		pagevec_release(&pvec);
+		if (((loff_t) next << PAGE_CACHE_SHIFT) < end)
+			end = (loff_t) next << PAGE_CACHE_SHIFT;
+	}
+	return end - pos;
+}
+
+/*
+ * POSIX_FADV_SEQUENTIAL doubles the readahead window of the file, such
+ * files are read through the page cache so that readahead keeps DMU reads
+ * in flight ahead of the reader. POSIX_FADV_RANDOM empties the window and
+ * POSIX_FADV_NORMAL restores it, both leave reads on the direct path.
+ */
+static inline int
+lzfs_ra_streaming(struct file *filep)
+{
+	return filep->f_ra.ra_pages > 
+		filep->f_mapping->backing_dev_info->ra_pages;
 }
 
 ssize_t
-lzfs_vnop_write (struct file *filep, const char __user *buf, size_t len, 
-		 loff_t *ppos)
+lzfs_vnop_read (struct file *filep, char __user *buf, size_t len, loff_t *ppos)
 {
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
 	int err;
+	const cred_t *cred = get_current_cred();
 	vnode_t *vp = NULL;
-	ssize_t i_size;
+	uio_t uio;
+	loff_t isize;
+	ssize_t size;
 
 	/* PAGE CACHE SUPPORT VARIABLES */
 	struct address_space *mapping = filep->f_mapping;
 	struct inode *inode = mapping->host;
+	struct file_ra_state *ra = &filep->f_ra;
 	pgoff_t index;
-	unsigned long written = 0;
-	unsigned long offset;
+	pgoff_t last_index;
+	pgoff_t prev_index;
+	unsigned long offset;      /* offset into pagecache page */
+	unsigned int prev_offset;
+	read_descriptor_t desc;
+	lzfs_rl_t rl;
 
-	const char *user_buf = buf;
+	vp  = LZFS_ITOV(inode);
+
+	desc.written = 0;
+	desc.arg.buf = buf;
+	desc.count   = len;
+	desc.error   = 0;
+
+	ENTRY;
+
+	if (filep->f_flags & O_DIRECT) {
+		put_cred(cred);
+		EXIT;
+		return lzfs_direct_rw(READ, filep, &iov, 1, ppos);
+	}
+
+	if ((err = lzfs_wb_flush(inode))) {
+		put_cred(cred);
+		tsd_exit();
+		EXIT;
+		return err;
+	}
+	lzfs_rl_enter(inode, &rl, *ppos, 
+			lzfs_rl_read_len(inode, *ppos, len), 0);
+
+	index = *ppos >> PAGE_CACHE_SHIFT;
+	prev_index = ra->prev_pos >> PAGE_CACHE_SHIFT;
+	prev_offset = ra->prev_pos & (PAGE_CACHE_SIZE - 1);
+	last_index = (*ppos + len + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+	offset = *ppos & ~PAGE_CACHE_MASK;
+
+	while (1) {
+		struct page *page;
+		pgoff_t end_index;
+		unsigned long nr, ret;
+
+#if 0
+		printk(KERN_INFO "desc.count=%ld, len=%ld, offset=%ld, pos=%lld\n", 
+				desc.count, len, offset, *ppos);
+#endif
+
+		if (!desc.count)
+			break;
+
+		BUG_ON(desc.written > len);
+
+		cond_resched();
+		page = find_get_page(mapping, index);
+		if (!page && lzfs_ra_streaming(filep)) {
+			/* POSIX_FADV_SEQUENTIAL: read ahead into the page cache */
+			page_cache_sync_readahead(mapping, ra, filep, index,
+					last_index - index);
+			page = find_get_page(mapping, index);
+		}
+		if (!page) {
+			/* NORMAL CASE: DATA IS NOT CACHED */
+			goto no_cached_page;
+		}
+
+		if (PageReadahead(page))
+			page_cache_async_readahead(mapping, ra, filep, page, 
+					index, last_index - index);
+
+		/* MMAPED OR READ AHEAD DATA: DATA IS CACHED */
+		if (!PageUptodate(page)) {
+			/* THE PAGE IS LOCKED UNTIL lzfs_fill_pages IS DONE 
+			 * WITH IT, ONCE WE GET IT LOCKED IT HAS TO BE UPTODATE */
+
+			lock_page(page);
+
+			if (!page->mapping) {
+				/* truncate happened */
+				unlock_page(page);
+				page_cache_release(page);
+				continue;
+			}
+
+			if (!PageUptodate(page)) {
+				/* readahead failed on it, read it once more 
+				 * as do_generic_file_read does */
+				ClearPageError(page);
+				err = mapping->a_ops->readpage(filep, page);
+				if (!err) {
+					wait_on_page_locked(page);
+					if (!PageUptodate(page))
+						err = -EIO;
+				}
+				if (err) {
+					page_cache_release(page);
+					goto out_error;
+				}
+			} else {
+				unlock_page(page);
+			}
+		}
+		isize = i_size_read(inode);
+		end_index = (isize - 1) >> PAGE_CACHE_SHIFT;
+		if (unlikely(!isize || index > end_index)) {
+			page_cache_release(page);
+			goto out;
+		}
+		/* nr is the maximum number of bytes to copy from this page */
+		nr = PAGE_CACHE_SIZE;
+		if (index == end_index) {
+			nr = ((isize - 1) & ~PAGE_CACHE_MASK) + 1;
+			if (nr <= offset) {
+				page_cache_release(page);
+				goto out;
+			}
+		}
+		nr = nr - offset;
+		mark_page_accessed(page);
+		prev_index = index;
+
+		ret = copy_data(&desc, page, offset, nr);
+		*ppos += ret;
+		offset += ret;
+		index  += (offset >> PAGE_CACHE_SHIFT);
+		offset &= ~PAGE_CACHE_MASK;
+		prev_offset = offset;
+
+		page_cache_release(page);
+
+#if 0
+		printk(KERN_ERR "%s: isize=%lld nr=%ld len=%ld offset=%ld desc.written=%ld desc.count=%ld pos=%lld.\n", 
+				__FUNCTION__, isize, nr, len, offset, desc.written, desc.count, *ppos);
+#endif
+
+		if (*ppos >= isize)
+			goto out;
+
+		if (ret == nr && desc.count)
+			continue;
+
+		goto out;
+no_cached_page:
+		isize = i_size_read(inode);
+		if (*ppos >= isize)
+			break;
+
+		/* one zfs_read for the whole uncached run */
+		size = lzfs_uncached_read_size(mapping, *ppos, desc.count, isize);
+
+		iov.iov_base = desc.arg.buf;
+		iov.iov_len  = size;
+
+		uio.uio_iov     = &iov;
+		uio.uio_iovcnt  = 1;
+		uio.uio_loffset = (offset_t) *ppos;
+		uio.uio_resid   = size;
+		uio.uio_segflg  = UIO_USERSPACE;
+		err = zfs_read(vp, &uio, 0,(cred_t *) cred, NULL);
+		lzfs_attr_accessed(inode);
+		if (unlikely(err)) {
+			err = -err;
+			goto out_error;
+		}
+
+		ret = size - uio.uio_resid;
+		if (!ret)
+			break;	/* file shrank under us */
+		desc.count    = desc.count - ret;
+		desc.written += ret;
+		desc.arg.buf += ret;
+		BUG_ON(desc.count < 0);
+
+		*ppos += ret;
+		prev_index = (*ppos - 1) >> PAGE_CACHE_SHIFT;
+		index  = *ppos >> PAGE_CACHE_SHIFT;
+		offset = *ppos & ~PAGE_CACHE_MASK;
+		prev_offset = offset;
+
+#if 0
+		printk(KERN_ERR "%s: isize=%lld size=%ld len=%ld offset=%ld written=%ld pos=%lld.\n", 
+				__FUNCTION__, isize, size, len, offset, desc.written, *ppos);
+#endif
+
+		if (!desc.count)
+			break; // goto out;
+	}
+
+out:
+//	*ppos = ((loff_t)index << PAGE_CACHE_SHIFT) + offset;
+
+	/* keep the readahead state used by lzfs_readpages current */
+	ra->prev_pos = prev_index;
+	ra->prev_pos <<= PAGE_CACHE_SHIFT;
+	ra->prev_pos |= prev_offset;
+
+	lzfs_rl_exit(inode, &rl);
+	zfs_file_accessed(vp);
+	put_cred(cred);
+	tsd_exit();
+	EXIT;
+	return ((ssize_t) (desc.written));
+out_error:
+	lzfs_rl_exit(inode, &rl);
+	put_cred(cred);
+	tsd_exit();
+	EXIT;
+	return err;
+}
+
+/* XXX --> Internal function used by lzfs_vnop_write and lzfs_writepage 
+ *
+ * Performs the write operation
+ *
+ * Explanation of parameters
+ * 		file_flags = struct file *file->f_flags
+ * 		buf        = buffer pointer to data
+ * 		len        = length of the data
+ * 		pos        = offest within file to wite
+ * 		segment    = indicates whether buf pointer points to 
+ * 		             user space buffer or kernel buffer.
+ * */
+ssize_t lzfs_write(vnode_t *vp, unsigned int file_flags, 
+		const char *buf, ssize_t len, loff_t pos, uio_seg_t segment)
+{
+	struct iovec iov;
+	ssize_t ret;
+
+	iov.iov_base = (void *) buf;
+	iov.iov_len  = len;
+
+	ret = lzfs_writev(vp, file_flags, &iov, 1, &pos, segment);
+	if (ret < 0)
+		return -ret;
+	return 0;
+}
+
+ssize_t
+lzfs_vnop_write (struct file *filep, const char __user *buf, size_t len, 
+		 loff_t *ppos)
+{
+	int err;
+	vnode_t *vp = NULL;
+	ssize_t ret;
+	int ranged = 0;
+	lzfs_rl_t rl;
+
+	/* PAGE CACHE SUPPORT VARIABLES */
+	struct address_space *mapping = filep->f_mapping;
+	struct inode *inode = mapping->host;
+	pgoff_t index;
+	unsigned long written = 0;
+	unsigned long offset;
+
+	const char *user_buf = buf;
+
+	/* pos_append would be equal to ppos, but if file is opened 
+	 * with O_APPEND flag pos_append would be assigned size of inode */
+	loff_t pos_append = 0;
+
+	ENTRY;
+
+	vp = LZFS_ITOV(inode);
+
+	if (filep->f_flags & O_DIRECT) {
+		struct iovec iov = { .iov_base = (void *) buf, .iov_len = len };
+
+		EXIT;
+		return lzfs_direct_rw(WRITE, filep, &iov, 1, ppos);
+	}
+
+	if (lzfs_wb_enabled(inode) && !(vp->v_flag & VMMAPPED) && 
+	    !mapping->nrpages) {
+		/* small writes go to the write-behind buffer, the rest is 
+		 * written once it is written out. Appends to the buffer
+		 * hold the append lock for as long as they take */
+		if (filep->f_flags & FAPPEND)
+			lzfs_append_lock(inode, &rl);
+		mutex_enter(&LZFS_ITOLZ(inode)->lz_wb_lock);
+		ret = lzfs_wb_write(inode, filep->f_flags, buf, len, ppos);
+		mutex_exit(&LZFS_ITOLZ(inode)->lz_wb_lock);
+		if (filep->f_flags & FAPPEND)
+			lzfs_rl_exit(inode, &rl);
+		if (ret < 0) {
+			err = ret;
+			goto out_error;
+		}
+		if (ret > 0) {
+			written = ret;
+			goto out_success;
+		}
+	} else if ((err = lzfs_wb_flush(inode))) {
+		goto out_error;
+	}
+
+	if (!(vp->v_flag & VMMAPPED)) {
+		/* file is not memory mmapped, pass the write directly to ZFS
+		 * in one piece, past whatever is still cached */
+		struct iovec iov = { .iov_base = (void *) buf, .iov_len = len };
+
+		ret = lzfs_writev_uncached(mapping, filep->f_flags, &iov, 1, 
+				ppos);
+		if (ret < 0) {
+			err = ret;
+			goto out_error;
+		}
+		written = ret;
+		goto out_success;
+	}
+
+	pos_append = *ppos;
+	if (filep->f_flags & FAPPEND) {
+		/* file is opened with the O_APPEND flag */
+		if ((err = lzfs_append_begin(inode, &rl, &pos_append)))
+			goto out_error;
+	} else {
+		lzfs_rl_enter(inode, &rl, pos_append, len, 1);
+	}
+	ranged = 1;
+
+	index = pos_append >> PAGE_CACHE_SHIFT;
+	offset = pos_append & ~PAGE_CACHE_MASK;
+
+	while (1) {
+		struct page *page = NULL;
+		char *page_buf;
+		ssize_t size;
+
+
+		if (written >= len)
+			break;
+
+		size = PAGE_CACHE_SIZE - offset;
+		if (written + size > len) {
+			size = len - written;
+		}
+
+		/* the copy into the page is made with page faults disabled,
+		 * so the source is faulted in first, and the copy retried 
+		 * when it was paged out again meanwhile */
+		if (unlikely(fault_in_pages_readable(user_buf, size))) {
+			err = -EFAULT;
+			goto out_error;
+		}
+
+		page = find_lock_page(mapping, index);
+		if (likely(!page)) {
+#if 0
+			printk ("%s: Page not cached. ppos=%llu, pos_append=%llu, offset=%ld, len=%ld, size=%ld\n", 
+					__FUNCTION__, *ppos, pos_append, offset, len, size);
+#endif
+			goto no_cached_page;
+		}
+#if 0
+		printk ("%s: Page cached. ppos=%llu, pos_append=%llu, offset=%ld, len=%ld, size=%ld\n", 
+					__FUNCTION__, *ppos, pos_append, offset, len, size);
+#endif
+
+		pagefault_disable();
+
+		/* copy the data */
+		BUG_ON(!in_atomic());
+		page_buf = kmap_atomic(page, KM_USER0);
+		if (__copy_from_user_inatomic(page_buf+offset, user_buf, 
+		    size)) {
+			kunmap_atomic(page_buf, KM_USER0);
+			pagefault_enable();
+			unlock_page(page);
+			page_cache_release(page);
+			continue;
+		}
+		kunmap_atomic(page_buf, KM_USER0);
+		pagefault_enable();
+
+		flush_dcache_page(page);
+		mark_page_accessed(page);
+
+		SetPageUptodate(page);
+		/* the cached page is written to ZFS by writeback */
+		set_page_dirty(page);
+		unlock_page(page);
+		page_cache_release(page);
+		zfs_file_modified(vp);
+		lzfs_attr_invalidate(inode);
+
+		balance_dirty_pages_ratelimited(mapping);
+
+		user_buf += size;
+		written  += size;
+		pos_append += size;
+		*ppos    =  pos_append;
+		index    =  pos_append >> PAGE_CACHE_SHIFT;
+		/* writeback writes the page out up to i_size */
+		if (pos_append > i_size_read(inode))
+			i_size_write(inode, pos_append);
+		offset   =  0;
+		continue;
+
+no_cached_page:
+		/* one zfs_write up to the next cached page */
+		size = lzfs_uncached_write_size(mapping, pos_append, 
+				len - written);
+
+		/* the end of file may still be in dirty pages, so O_APPEND 
+		 * writes go to pos_append and not wherever ZFS thinks it is */
+		err = lzfs_write(vp, filep->f_flags & ~FAPPEND, user_buf, size, 
+				pos_append, UIO_USERSPACE);
+		if (unlikely(err)) {
+			err = -err;
+			goto out_error;
+		}
+
+		pos_append += size;
+		*ppos    =  pos_append;
+		user_buf += size;
+		written  += size;
+		index    =  pos_append >> PAGE_CACHE_SHIFT;
+		offset   =  0;
+	}
+
+out_success:
+	if (ranged)
+		lzfs_rl_exit(inode, &rl);
+	tsd_exit();
+	EXIT;
+	return ((ssize_t) written);
+out_error:
+	if (ranged)
+		lzfs_rl_exit(inode, &rl);
+	tsd_exit();
+	EXIT;
+	return err;
+}
+
+/*
+ * Vectored read: when nothing of the file is in the page cache the whole 
+ * iovec array goes to ZFS in one zfs_read, otherwise each segment takes 
+ * the page cache aware lzfs_vnop_read.
+ */
+static ssize_t
+lzfs_file_readv(struct file *filep, const struct iovec *iov, 
+		unsigned long nr_segs, loff_t *ppos)
+{
+	struct address_space *mapping = filep->f_mapping;
+	vnode_t *vp = LZFS_ITOV(mapping->host);
+	ssize_t ret, done = 0;
+	unsigned long seg;
+	lzfs_rl_t rl;
+
+	if (filep->f_flags & O_DIRECT)
+		return lzfs_direct_rw(READ, filep, iov, nr_segs, ppos);
+
+	if ((ret = lzfs_wb_flush(mapping->host)))
+		return ret;
+
+	if (!mapping->nrpages) {
+		lzfs_rl_enter(mapping->host, &rl, *ppos, 
+				lzfs_rl_read_len(mapping->host, *ppos, 
+				iov_length(iov, nr_segs)), 0);
+		ret = lzfs_readv(vp, iov, nr_segs, ppos, UIO_USERSPACE);
+		lzfs_rl_exit(mapping->host, &rl);
+		if (ret >= 0)
+			zfs_file_accessed(vp);
+		tsd_exit();
+		return ret;
+	}
+
+	for (seg = 0; seg < nr_segs; seg++) {
+		ret = lzfs_vnop_read(filep, iov[seg].iov_base, 
+				iov[seg].iov_len, ppos);
+		if (ret < 0)
+			return done ? done : ret;
+		done += ret;
+		if (ret < iov[seg].iov_len)
+			break;
+	}
+	return done;
+}
+
+/*
+ * Vectored write: unless the file is mapped the whole iovec array goes to 
+ * ZFS in one zfs_write, see lzfs_writev_uncached, otherwise each segment 
+ * takes the page cache aware lzfs_vnop_write.
+ */
+static ssize_t
+lzfs_file_writev(struct file *filep, const struct iovec *iov, 
+		unsigned long nr_segs, loff_t *ppos)
+{
+	struct address_space *mapping = filep->f_mapping;
+	vnode_t *vp = LZFS_ITOV(mapping->host);
+	ssize_t ret, done = 0;
+	unsigned long seg;
+
+	if (filep->f_flags & O_DIRECT)
+		return lzfs_direct_rw(WRITE, filep, iov, nr_segs, ppos);
+
+	if (!(vp->v_flag & VMMAPPED)) {
+		if ((ret = lzfs_wb_flush(mapping->host)))
+			return ret;
+		ret = lzfs_writev_uncached(mapping, filep->f_flags, iov, 
+				nr_segs, ppos);
+		tsd_exit();
+		return ret;
+	}
+
+	for (seg = 0; seg < nr_segs; seg++) {
+		ret = lzfs_vnop_write(filep, iov[seg].iov_base, 
+				iov[seg].iov_len, ppos);
+		if (ret < 0)
+			return done ? done : ret;
+		done += ret;
+	}
+	return done;
+}
+
+/*
+ * io_submit requests are carried out by the lzfs_aio taskq so that a 
+ * process can keep many of them in flight against one file. The worker 
+ * borrows the submitter's mm and credentials for the duration.
+ */
+static int lzfs_aio_threads = 16;
+module_param(lzfs_aio_threads, int, 0444);
+MODULE_PARM_DESC(lzfs_aio_threads, "Threads servicing io_submit requests");
+
+static taskq_t *lzfs_aio_taskq = NULL;
+
+/*
+ * Readahead is filled by its own taskq, aio workers may wait for pages 
+ * that are queued there.
+ */
+static int lzfs_ra_threads = 8;
+module_param(lzfs_ra_threads, int, 0444);
+MODULE_PARM_DESC(lzfs_ra_threads, "Threads filling readahead windows");
+
+static taskq_t *lzfs_ra_taskq = NULL;
+
+typedef struct lzfs_aio {
+	struct kiocb		*la_iocb;
+	const struct iovec	*la_iov;
+	unsigned long		la_nr_segs;
+	loff_t			la_pos;
+	int			la_rw;
+	const struct cred	*la_cred;
+} lzfs_aio_t;
+
+static void
+lzfs_aio_work(void *arg)
+{
+	lzfs_aio_t *aio = (lzfs_aio_t *)arg;
+	struct kiocb *iocb = aio->la_iocb;
+	struct mm_struct *mm = iocb->ki_ctx->mm;
+	const struct cred *saved;
+	ssize_t ret;
+
+	use_mm(mm);
+	saved = override_creds(aio->la_cred);
+	if (aio->la_rw == READ)
+		ret = lzfs_file_readv(iocb->ki_filp, aio->la_iov, 
+				aio->la_nr_segs, &aio->la_pos);
+	else
+		ret = lzfs_file_writev(iocb->ki_filp, aio->la_iov, 
+				aio->la_nr_segs, &aio->la_pos);
+	revert_creds(saved);
+	unuse_mm(mm);
+	lzfs_throttle(iocb->ki_filp->f_mapping->host, aio->la_rw, ret);
+
+	put_cred(aio->la_cred);
+	kfree(aio);
+	aio_complete(iocb, ret, 0);
+}
+
+/* Returns -EIOCBQUEUED, or 0 when the caller has to do the I/O itself */
+static ssize_t
+lzfs_aio_queue(struct kiocb *iocb, const struct iovec *iov,
+		unsigned long nr_segs, loff_t pos, int rw)
+{
+	lzfs_aio_t *aio;
+
+	if (lzfs_aio_taskq == NULL)
+		return 0;
+	if ((aio = kmalloc(sizeof(lzfs_aio_t), GFP_KERNEL)) == NULL)
+		return 0;
+
+	/* iov is the kiocb's own array, it lives until aio_complete */
+	aio->la_iocb     = iocb;
+	aio->la_iov      = iov;
+	aio->la_nr_segs  = nr_segs;
+	aio->la_pos      = pos;
+	aio->la_rw       = rw;
+	aio->la_cred     = get_current_cred();
+
+	if (!taskq_dispatch(lzfs_aio_taskq, lzfs_aio_work, aio, TQ_SLEEP)) {
+		put_cred(aio->la_cred);
+		kfree(aio);
+		return 0;
+	}
+	return -EIOCBQUEUED;
+}
+
+static ssize_t
+lzfs_vnop_aio_read(struct kiocb *iocb, const struct iovec *iov,
+		unsigned long nr_segs, loff_t pos)
+{
+	ssize_t ret;
+
+	lzfs_free_wait(iocb->ki_filp->f_mapping->host);
+	if (!is_sync_kiocb(iocb) &&
+	    (ret = lzfs_aio_queue(iocb, iov, nr_segs, pos, READ)))
+		return ret;
+	ret = lzfs_file_readv(iocb->ki_filp, iov, nr_segs, &iocb->ki_pos);
+	lzfs_throttle(iocb->ki_filp->f_mapping->host, READ, ret);
+	return ret;
+}
+
+static ssize_t
+lzfs_vnop_aio_write(struct kiocb *iocb, const struct iovec *iov,
+		unsigned long nr_segs, loff_t pos)
+{
+	ssize_t ret;
+
+	lzfs_free_wait(iocb->ki_filp->f_mapping->host);
+	if (!is_sync_kiocb(iocb) &&
+	    (ret = lzfs_aio_queue(iocb, iov, nr_segs, pos, WRITE)))
+		return ret;
+	ret = lzfs_file_writev(iocb->ki_filp, iov, nr_segs, &iocb->ki_pos);
+	lzfs_throttle(iocb->ki_filp->f_mapping->host, WRITE, ret);
+	return ret;
+}
+
+/*
+ * read(2) and write(2), the I/O limits of the mount are applied here and 
+ * in the other entry points rather than in lzfs_vnop_read/write, which 
+ * also serve readv and aio segment by segment. They are charged once the
+ * I/O is done, with what it transferred.
+ */
+static ssize_t
+lzfs_file_read(struct file *filep, char __user *buf, size_t len, 
+		loff_t *ppos)
+{
+	ssize_t ret;
+
+	lzfs_free_wait(filep->f_mapping->host);
+	ret = lzfs_vnop_read(filep, buf, len, ppos);
+	lzfs_throttle(filep->f_mapping->host, READ, ret);
+	return ret;
+}
+
+static ssize_t
+lzfs_file_write(struct file *filep, const char __user *buf, size_t len, 
+		loff_t *ppos)
+{
+	ssize_t ret;
+
+	lzfs_free_wait(filep->f_mapping->host);
+	ret = lzfs_vnop_write(filep, buf, len, ppos);
+	lzfs_throttle(filep->f_mapping->host, WRITE, ret);
+	return ret;
+}
+
+int
+lzfs_vnops_init(void)
+{
+	lzfs_aio_taskq = taskq_create("lzfs_aio", lzfs_aio_threads, 
+			minclsyspri, lzfs_aio_threads, INT_MAX, 
+			TASKQ_PREPOPULATE);
+	if (lzfs_aio_taskq == NULL)
+		return -ENOMEM;
+
+	lzfs_ra_taskq = taskq_create("lzfs_ra", lzfs_ra_threads, 
+			minclsyspri, lzfs_ra_threads, INT_MAX, 
+			TASKQ_PREPOPULATE);
+	if (lzfs_ra_taskq == NULL)
+		goto out_aio;
+
+	lzfs_wb_taskq = taskq_create("lzfs_wb", 1, minclsyspri, 1, INT_MAX, 
+			TASKQ_PREPOPULATE);
+	if (lzfs_wb_taskq == NULL)
+		goto out_ra;
+
+	register_shrinker(&lzfs_wb_shrinker);
+	return 0;
+
+out_ra:
+	taskq_destroy(lzfs_ra_taskq);
+	lzfs_ra_taskq = NULL;
+out_aio:
+	taskq_destroy(lzfs_aio_taskq);
+	lzfs_aio_taskq = NULL;
+	return -ENOMEM;
+}
+
+void
+lzfs_vnops_fini(void)
+{
+	unregister_shrinker(&lzfs_wb_shrinker);
+	taskq_destroy(lzfs_wb_taskq);
+	lzfs_wb_taskq = NULL;
+	taskq_destroy(lzfs_ra_taskq);
+	lzfs_ra_taskq = NULL;
+	taskq_destroy(lzfs_aio_taskq);
+	lzfs_aio_taskq = NULL;
+}
+
+/*
+ * Copies len bytes of kernel data, already written to ZFS at pos, into the 
+ * pages of that range which are cached for mmap so that mappings and 
+ * cached reads observe the write.
+ */
+static void
+lzfs_update_cached_pages(struct address_space *mapping, loff_t pos,
+		const char *buf, size_t len)
+{
+	while (len) {
+		pgoff_t index = pos >> PAGE_CACHE_SHIFT;
+		unsigned long offset = pos & ~PAGE_CACHE_MASK;
+		size_t size = min_t(size_t, PAGE_CACHE_SIZE - offset, len);
+		struct page *page;
+		char *page_buf;
+
+		page = find_lock_page(mapping, index);
+		if (page) {
+			page_buf = kmap_atomic(page, KM_USER0);
+			memcpy(page_buf + offset, buf, size);
+			kunmap_atomic(page_buf, KM_USER0);
+			flush_dcache_page(page);
+			unlock_page(page);
+			page_cache_release(page);
+		}
+
+		pos += size;
+		buf += size;
+		len -= size;
+	}
+}
+
+/*
+ * splice_from_pipe actor: the pipe page is handed to zfs_write as a kernel
+ * buffer, so the data never goes through userspace.
+ */
+static int
+lzfs_pipe_to_file(struct pipe_inode_info *pipe, struct pipe_buffer *buf,
+		struct splice_desc *sd)
+{
+	struct file *filep = sd->u.file;
+	struct address_space *mapping = filep->f_mapping;
+	vnode_t *vp = LZFS_ITOV(mapping->host);
+	char *src;
+	int err;
+
+	err = buf->ops->confirm(pipe, buf);
+	if (unlikely(err))
+		return err;
+
+	src = buf->ops->map(pipe, buf, 0);
+	err = lzfs_write(vp, filep->f_flags & ~FAPPEND, src + buf->offset, 
+			sd->len, sd->pos, UIO_SYSSPACE);
+	if (!err && mapping->nrpages)
+		lzfs_update_cached_pages(mapping, sd->pos, src + buf->offset, 
+				sd->len);
+	buf->ops->unmap(pipe, buf, src);
+
+	if (unlikely(err))
+		return -err;
+	return sd->len;
+}
+
+static ssize_t
+lzfs_file_splice_write(struct pipe_inode_info *pipe, struct file *out,
+		loff_t *ppos, size_t len, unsigned int flags)
+{
+	struct inode *inode = out->f_mapping->host;
+	ssize_t ret;
+
+	ENTRY;
+	/* the pipe is drained at *ppos, there is no end of file to chase */
+	if (out->f_flags & O_APPEND) {
+		EXIT;
+		return -EINVAL;
+	}
+
+	lzfs_free_wait(inode);
+	if ((ret = lzfs_wb_flush(inode))) {
+		EXIT;
+		return ret;
+	}
+	ret = splice_from_pipe(pipe, out, ppos, len, flags, lzfs_pipe_to_file);
+	if (ret > 0)
+		*ppos += ret;
+	tsd_exit();
+	lzfs_throttle(inode, WRITE, ret);
+	EXIT;
+	return ret;
+}
+
+/* splice_read fills the page cache, buffered writes have to be there first */
+static ssize_t
+lzfs_file_splice_read(struct file *in, loff_t *ppos, 
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	ssize_t ret;
+
+	lzfs_free_wait(in->f_mapping->host);
+	if ((ret = lzfs_wb_flush(in->f_mapping->host)))
+		return ret;
+	ret = generic_file_splice_read(in, ppos, pipe, len, flags);
+	lzfs_throttle(in->f_mapping->host, READ, ret);
+	return ret;
+}
+
+/*
+ * Called at every close: the writer's close reports a failed write out of
+ * its buffered data, like fsync would.
+ */
+static int
+lzfs_vnop_flush(struct file *filep, fl_owner_t id)
+{
+	struct inode *inode = filep->f_mapping->host;
+	int err, ferr;
+
+	if (!(filep->f_mode & FMODE_WRITE))
+		return lzfs_wb_flush(inode);
+	ferr = lzfs_free_error(inode);
+	err = lzfs_wb_sync(inode);
+	return err ? err : ferr;
+}
+
+const struct inode_operations zfs_symlink_inode_operations = {
+    .readlink       = generic_readlink,
+    .follow_link    = lzfs_follow_link,
+    .put_link       = lzfs_put_link,
+};
+
+static int lzfs_holey(struct inode *inode, int whence, loff_t *off);
+
+/*
+ * Moves *off to the next data (SEEK_DATA) or hole (SEEK_HOLE) at or after 
+ * it. zfs_holey answers from the block pointers of the object, so dirty 
+ * mmap pages are written back first to be accounted as data. While the 
+ * object has changes in an open txg the block pointers are not settled
+ * and ZFS returns EBUSY; the whole file is then reported as data, which 
+ * is always correct. Returns -ENXIO when *off is at or past EOF.
+ */
+static int
+lzfs_seek_data_hole(struct inode *inode, int whence, loff_t *off)
+{
+	loff_t isize;
+
+	lzfs_free_wait(inode);
+	lzfs_wb_flush(inode);
+	isize = i_size_read(inode);
+	if (*off < 0 || *off >= isize)
+		return -ENXIO;
+
+	if (inode->i_mapping->nrpages)
+		filemap_write_and_wait(inode->i_mapping);
+	return lzfs_holey(inode, whence, off);
+}
+
+/* lzfs_seek_data_hole for callers that have done the write back */
+static int
+lzfs_holey(struct inode *inode, int whence, loff_t *off)
+{
+	vnode_t *vp = LZFS_ITOV(inode);
+	const struct cred *cred;
+	offset_t noff = *off;
+	loff_t isize = i_size_read(inode);
+	int rval, err;
+
+	cred = get_current_cred();
+	err = zfs_ioctl(vp, whence == SEEK_DATA ? _FIO_SEEK_DATA : 
+			_FIO_SEEK_HOLE, (intptr_t)&noff, FKIOCTL, 
+			(cred_t *)cred, &rval, NULL);
+	put_cred(cred);
+
+	if (err == EBUSY) {
+		if (whence == SEEK_HOLE)
+			*off = isize;
+		return 0;
+	}
+	if (err)
+		return -err;
+
+	*off = noff;
+	return 0;
+}
+
+static loff_t
+lzfs_vnop_llseek(struct file *filep, loff_t offset, int origin)
+{
+	struct inode *inode = filep->f_mapping->host;
+	int err;
+
+	if (origin == SEEK_END)
+		lzfs_wb_flush(inode);
+	if (origin != SEEK_DATA && origin != SEEK_HOLE)
+		return generic_file_llseek(filep, offset, origin);
+
+	ENTRY;
+	mutex_lock(&inode->i_mutex);
+	err = lzfs_seek_data_hole(inode, origin, &offset);
+	if (!err && offset != filep->f_pos) {
+		filep->f_pos = offset;
+		filep->f_version = 0;
+	}
+	mutex_unlock(&inode->i_mutex);
+	tsd_exit();
+	EXIT;
+	if (err)
+		return err;
+	return offset;
+}
+
+/*
+ * Reports the data extents of a file using the same block pointer walk as
+ * SEEK_DATA/SEEK_HOLE; holes are simply absent from the map. ZFS does not
+ * let lzfs see where a block lives (it may have several DVAs, or none for 
+ * embedded data) nor how it is stored, so extents have no physical address
+ * and are flagged FIEMAP_EXTENT_UNKNOWN.
+ */
+static int
+lzfs_vnop_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+		u64 start, u64 len)
+{
+	loff_t isize, end, data, hole;
+	u32 flags;
+	int err;
+
+	err = fiemap_check_flags(fieinfo, FIEMAP_FLAG_SYNC);
+	if (err)
+		return err;
+
+	ENTRY;
+	mutex_lock(&inode->i_mutex);
+	lzfs_wb_flush(inode);
+	isize = i_size_read(inode);
+	end = isize;
+	if (start < isize && len < isize - start)
+		end = start + len;
+
+	for (data = start; data < end; data = hole) {
+		err = lzfs_seek_data_hole(inode, SEEK_DATA, &data);
+		if (err == -ENXIO) {
+			/* only a hole is left */
+			err = 0;
+			break;
+		}
+		if (err || data >= end)
+			break;
+
+		hole = data;
+		err = lzfs_seek_data_hole(inode, SEEK_HOLE, &hole);
+		if (err)
+			break;
+
+		flags = FIEMAP_EXTENT_UNKNOWN;
+		if (hole >= isize)
+			flags |= FIEMAP_EXTENT_LAST;
+		err = fiemap_fill_next_extent(fieinfo, data, 0, hole - data, 
+				flags);
+		if (err) {
+			/* 1 means the caller's extent array is full */
+			if (err == 1)
+				err = 0;
+			break;
+		}
+	}
+	mutex_unlock(&inode->i_mutex);
+	tsd_exit();
+	EXIT;
+	return err;
+}
+
+/*
+ * ZFS allocates blocks when they are written (copy on write), so there is 
+ * nothing to preallocate: plain fallocate only verifies that the growth 
+ * fits in the dataset and, without FALLOC_FL_KEEP_SIZE, extends the file.
+ * FALLOC_FL_PUNCH_HOLE and FALLOC_FL_ZERO_RANGE free the blocks of the 
+ * range with F_FREESP. Dirty mmap pages are written back before the free
+ * and the cached copies of the range dropped after it.
+ */
+static long
+lzfs_vnop_fallocate(struct inode *inode, int mode, loff_t offset, loff_t len)
+{
+	vnode_t *vp = LZFS_ITOV(inode);
+	struct address_space *mapping = inode->i_mapping;
+	loff_t end = offset + len;
+	const struct cred *cred;
+	struct statvfs64 stat;
+	loff_t isize, free_end;
+	lzfs_rl_t rl;
+	vattr_t *vap;
+	flock64_t bf;
+	int err = 0;
 
-	/* pos_append would be equal to ppos, but if file is opened 
-	 * with O_APPEND flag pos_append would be assigned size of inode */
-	loff_t pos_append = 0;
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | 
+	    FALLOC_FL_ZERO_RANGE))
+		return -EOPNOTSUPP;
+	/* punching a hole never changes the file size */
+	if ((mode & FALLOC_FL_PUNCH_HOLE) && 
+	    (!(mode & FALLOC_FL_KEEP_SIZE) || (mode & FALLOC_FL_ZERO_RANGE)))
+		return -EOPNOTSUPP;
+	if (offset < 0 || len <= 0)
+		return -EINVAL;
 
 	ENTRY;
-
-	vp = LZFS_ITOV(inode);
-
-	if (!(vp->v_flag & VMMAPPED)) {
-		/* file is not memory mmapped, pass read directly to ZFS */
-		err = lzfs_write(vp, filep->f_flags, buf, len, *ppos, UIO_USERSPACE);
-		if (unlikely(err)) {
-			err = -err;
-			goto out_error;
+	cred = get_current_cred();
+	mutex_lock(&inode->i_mutex);
+	lzfs_free_wait(inode);
+	lzfs_wb_flush(inode);
+	isize = i_size_read(inode);
+
+	if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+		free_end = (end < isize) ? end : isize;
+		if (offset < free_end) {
+			lzfs_rl_enter(inode, &rl, offset, free_end - offset, 1);
+			if (mapping->nrpages)
+				filemap_write_and_wait_range(mapping, offset, 
+						free_end - 1);
+
+			bzero(&bf, sizeof(flock64_t));
+			bf.l_type   = F_WRLCK;
+			bf.l_whence = 0;
+			bf.l_start  = offset;
+			bf.l_len    = free_end - offset;
+			err = zfs_space(vp, F_FREESP, &bf, FWRITE, offset, 
+					(cred_t *)cred, NULL);
+			if (!err)
+				lzfs_mark_data_dirty(vp);
+
+			if (mapping->nrpages)
+				invalidate_inode_pages2_range(mapping, 
+					offset >> PAGE_CACHE_SHIFT,
+					(free_end - 1) >> PAGE_CACHE_SHIFT);
+			lzfs_rl_exit(inode, &rl);
+			if (err)
+				goto out;
+		}
+	} else if (end > isize) {
+		err = zfs_statvfs(inode->i_sb->s_fs_info, &stat);
+		if (err)
+			goto out;
+		if (end - isize > stat.f_bavail * stat.f_frsize) {
+			err = ENOSPC;
+			goto out;
 		}
-		*ppos += len;
-		written = len;
-		goto out_success;
 	}
 
-	i_size = i_size_read(inode);
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > isize) {
+		err = -vmtruncate(inode, end);
+		if (err)
+			goto out;
 
-	pos_append = *ppos;
-	if (filep->f_flags & FAPPEND) {
-		/* file is opened with the O_APPEND flag */
-		pos_append = i_size;
+		vap = kzalloc(sizeof(vattr_t), GFP_KERNEL);
+		if (vap == NULL) {
+			err = ENOMEM;
+			goto out;
+		}
+		vap->va_type = IFTOVT(inode->i_mode);
+		vap->va_mask = AT_TYPE | AT_SIZE;
+		vap->va_size = end;
+		err = zfs_setattr(vp, vap, 0, (struct cred *)cred, NULL);
+		kfree(vap);
+		if (!err)
+			lzfs_mark_data_dirty(vp);
 	}
+out:
+	mutex_unlock(&inode->i_mutex);
+	put_cred(cred);
+	tsd_exit();
+	EXIT;
+	return -err;
+}
 
-	index = pos_append >> PAGE_CACHE_SHIFT;
-	offset = pos_append & ~PAGE_CACHE_MASK;
+/* longest copy of one LZFS_IOC_COPY_RANGE, what read and write allow */
+#define LZFS_COPY_MAX	(INT_MAX & PAGE_CACHE_MASK)
 
-	while (1) {
-		struct page *page = NULL;
-		char *page_buf;
-		ssize_t size;
+/*
+ * Copies len bytes at soff of src to doff of dst inside the kernel, a 
+ * record at a time through zfs_read and zfs_write on a kernel buffer. The
+ * data runs of the source are found with lzfs_holey; the holes 
+ * between them are freed in the destination with F_FREESP, or simply not
+ * written past its end, so the copy is as sparse as the source. Both 
+ * ranges are range locked, the lower inode (or offset) first so that two 
+ * copies in opposite directions cannot deadlock. Returns the bytes copied
+ * or a negative errno.
+ */
+static ssize_t
+lzfs_copy_range(struct file *src, loff_t soff, struct file *dst, loff_t doff,
+		size_t len)
+{
+	struct inode *sip = src->f_mapping->host;
+	struct inode *dip = dst->f_mapping->host;
+	vnode_t *svp = LZFS_ITOV(sip);
+	vnode_t *dvp = LZFS_ITOV(dip);
+	const struct cred *cred;
+	loff_t isize, send, pos, dpos, data, hole;
+	lzfs_rl_t srl, drl;
+	struct iovec iov;
+	size_t bsize;
+	flock64_t bf;
+	vattr_t *vap;
+	ssize_t ret;
+	char *buf;
+	int err;
 
+	lzfs_free_wait(sip);
+	lzfs_free_wait(dip);
+	if ((err = lzfs_wb_flush(sip)) || (err = lzfs_wb_flush(dip)))
+		return err;
 
-		if (written >= len)
-			break;
+	isize = i_size_read(sip);
+	if (soff >= isize || len == 0)
+		return 0;
+	if (len > isize - soff)
+		len = isize - soff;
+	if (len > LZFS_COPY_MAX)
+		len = LZFS_COPY_MAX;
+	if (sip == dip && soff < doff + len && doff < soff + len)
+		return -EINVAL;
+
+	bsize = sip->i_sb->s_blocksize;
+	buf = kmalloc(bsize, GFP_KERNEL | __GFP_NOWARN);
+	if (buf == NULL) {
+		bsize = PAGE_SIZE;
+		if ((buf = kmalloc(bsize, GFP_KERNEL)) == NULL)
+			return -ENOMEM;
+	}
 
-		size = PAGE_CACHE_SIZE - offset;
-		if (written + size > len) {
-			size = len - written;
+	if (sip < dip || (sip == dip && soff < doff)) {
+		lzfs_rl_enter(sip, &srl, soff, len, 0);
+		lzfs_rl_enter(dip, &drl, doff, len, 1);
+	} else {
+		lzfs_rl_enter(dip, &drl, doff, len, 1);
+		lzfs_rl_enter(sip, &srl, soff, len, 0);
+	}
+	if (src->f_mapping->nrpages)
+		filemap_write_and_wait_range(src->f_mapping, soff, 
+				soff + len - 1);
+	if (dst->f_mapping->nrpages)
+		filemap_write_and_wait_range(dst->f_mapping, doff, 
+				doff + len - 1);
+
+	cred = get_current_cred();
+	send = soff + len;
+	pos  = soff;
+	dpos = doff;
+	while (pos < send) {
+		data = pos;
+		err = lzfs_holey(sip, SEEK_DATA, &data);
+		if (err == -ENXIO) {
+			/* only a hole is left */
+			data = send;
+			err = 0;
 		}
-
-		page = find_lock_page(mapping, index);
-		if (likely(!page)) {
-#if 0
-			printk ("%s: Page not cached. ppos=%llu, pos_append=%llu, offset=%ld, len=%ld, size=%ld\n", 
-					__FUNCTION__, *ppos, pos_append, offset, len, size);
-#endif
-			goto no_cached_page;
+		if (err)
+			break;
+		if (data > send)
+			data = send;
+
+		if (data > pos) {
+			isize = i_size_read(dip);
+			if (dpos < isize) {
+				bzero(&bf, sizeof(flock64_t));
+				bf.l_type   = F_WRLCK;
+				bf.l_whence = 0;
+				bf.l_start  = dpos;
+				bf.l_len    = min_t(loff_t, data - pos, 
+						isize - dpos);
+				err = -zfs_space(dvp, F_FREESP, &bf, FWRITE, 
+						dpos, (cred_t *)cred, NULL);
+				if (err)
+					break;
+				lzfs_mark_data_dirty(dvp);
+			}
+			dpos += data - pos;
+			pos = data;
+			continue;
 		}
-#if 0
-		printk ("%s: Page cached. ppos=%llu, pos_append=%llu, offset=%ld, len=%ld, size=%ld\n", 
-					__FUNCTION__, *ppos, pos_append, offset, len, size);
-#endif
-
-		pagefault_disable();
 
-		/* copy the data */
-		BUG_ON(!in_atomic());
-		page_buf = kmap_atomic(page, KM_USER0);
-		if (copy_from_user(page_buf+offset, user_buf, size)) {
-			kunmap(page);
-			unlock_page(page);
-			err = -EFAULT;
-			goto out_error;
+		hole = pos;
+		err = lzfs_holey(sip, SEEK_HOLE, &hole);
+		if (err) {
+			/* -ENXIO: the source shrank under us */
+			if (err == -ENXIO)
+				err = 0;
+			break;
 		}
-		kunmap_atomic(page_buf, KM_USER0);
-		pagefault_enable();
+		if (hole > send)
+			hole = send;
+
+		while (pos < hole) {
+			iov.iov_base = buf;
+			iov.iov_len  = min_t(loff_t, bsize, hole - pos);
+			ret = lzfs_readv(svp, &iov, 1, &pos, UIO_SYSSPACE);
+			if (ret <= 0) {
+				err = ret;
+				goto done;
+			}
+			iov.iov_len = ret;
+			ret = lzfs_writev(dvp, 0, &iov, 1, &dpos, UIO_SYSSPACE);
+			if (ret < 0) {
+				err = ret;
+				goto done;
+			}
+			if (ret < iov.iov_len) {
+				err = -ENOSPC;
+				goto done;
+			}
+		}
+	}
+done:
+	/*
+	 * A hole at the end of the source still makes the file that long. 
+	 * Growing i_size leaves the page cache alone, so when ZFS does not
+	 * take the size the old one is simply put back.
+	 */
+	isize = i_size_read(dip);
+	if (dpos > isize && !vmtruncate(dip, dpos)) {
+		vap = kzalloc(sizeof(vattr_t), GFP_KERNEL);
+		if (vap != NULL) {
+			vap->va_type = IFTOVT(dip->i_mode);
+			vap->va_mask = AT_TYPE | AT_SIZE;
+			vap->va_size = dpos;
+			if (!zfs_setattr(dvp, vap, 0, (struct cred *)cred, NULL))
+				lzfs_mark_data_dirty(dvp);
+			else
+				i_size_write(dip, isize);
+			kfree(vap);
+		} else {
+			i_size_write(dip, isize);
+		}
+	}
+	if (dpos > doff && dst->f_mapping->nrpages)
+		invalidate_inode_pages2_range(dst->f_mapping, 
+			doff >> PAGE_CACHE_SHIFT, (dpos - 1) >> PAGE_CACHE_SHIFT);
+	put_cred(cred);
 
-		flush_dcache_page(page);
-		mark_page_accessed(page);
+	lzfs_rl_exit(sip, &srl);
+	lzfs_rl_exit(dip, &drl);
+	kfree(buf);
+	ret = (dpos > doff) ? dpos - doff : err;
+	lzfs_throttle(sip, READ, ret);
+	lzfs_throttle(dip, WRITE, ret);
+	return ret;
+}
 
-		/* do i need to modify the inode size */
-		SetPageUptodate(page);
-//		set_page_dirty(page);
-		unlock_page(page);
-		page_cache_release(page);
-		zfs_file_modified(vp);
+/* LZFS_IOC_COPY_RANGE, filep is the destination */
+static long
+lzfs_ioc_copy_range(struct file *filep, unsigned long arg)
+{
+	struct lzfs_copy_range lcr;
+	struct file *src;
+	loff_t soff, doff;
+	size_t len;
+	long ret;
+
+	if (copy_from_user(&lcr, (void __user *)arg, sizeof(lcr)))
+		return -EFAULT;
+	if (lcr.lcr_flags)
+		return -EINVAL;
+	if ((loff_t)lcr.lcr_src_off < 0 || (loff_t)lcr.lcr_dst_off < 0 ||
+	    lcr.lcr_len > LLONG_MAX - lcr.lcr_dst_off)
+		return -EINVAL;
+	if ((src = fget(lcr.lcr_src_fd)) == NULL)
+		return -EBADF;
+
+	ret = -EBADF;
+	if (!(src->f_mode & FMODE_READ) || !(filep->f_mode & FMODE_WRITE) ||
+	    (filep->f_flags & O_APPEND))
+		goto out;
+	/* the source has to be a regular file of an lzfs mount as well */
+	ret = -EXDEV;
+	if (src->f_op != filep->f_op)
+		goto out;
+	ret = -EINVAL;
+	if (!S_ISREG(src->f_mapping->host->i_mode) || 
+	    !S_ISREG(filep->f_mapping->host->i_mode))
+		goto out;
 
-		balance_dirty_pages_ratelimited(mapping);
+	/* the checks of read and write: mandatory locks, LSM hooks, limits */
+	soff = lcr.lcr_src_off;
+	doff = lcr.lcr_dst_off;
+	len  = min_t(u64, lcr.lcr_len, LZFS_COPY_MAX);
+	if ((ret = rw_verify_area(READ, src, &soff, len)) < 0)
+		goto out;
+	len = ret;
+	if ((ret = rw_verify_area(WRITE, filep, &doff, len)) < 0)
+		goto out;
+	len = ret;
 
-		user_buf += size;
-		written  += size;
-		*ppos    += size;
-		pos_append += size;
-		index    =  pos_append >> PAGE_CACHE_SHIFT;
-		if (*ppos != pos_append) {
-			/* file is opened with the O_APPEND flag */
-			BUG_ON(!(filep->f_flags & FAPPEND));
-			i_size_write(inode, i_size + size);
-		}
-		offset   =  0;
-		continue;
+	ret = lzfs_copy_range(src, soff, filep, doff, len);
+	tsd_exit();
+	if (ret > 0) {
+		lcr.lcr_src_off += ret;
+		lcr.lcr_dst_off += ret;
+		if (copy_to_user((void __user *)arg, &lcr, sizeof(lcr)))
+			ret = -EFAULT;
+	}
+out:
+	fput(src);
+	return ret;
+}
 
-no_cached_page:
-		err = lzfs_write(vp, filep->f_flags, user_buf, size, *ppos, UIO_USERSPACE);
-		if (unlikely(err)) {
-			err = -err;
-			goto out_error;
-		}
+/*
+ * _FIO_SEEK_DATA and _FIO_SEEK_HOLE take a pointer to the starting offset 
+ * and return the result in it, for kernels whose lseek rejects SEEK_DATA 
+ * and SEEK_HOLE. LZFS_IOC_COPY_RANGE is copy_file_range, see lzfs_ioctl.h.
+ */
+static long
+lzfs_fop_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+{
+	struct inode *inode = filep->f_path.dentry->d_inode;
+	loff_t off;
+	int err;
 
-		*ppos += size;
-		pos_append += size;
-		user_buf += size;
-		written  += size;
-		index    =  *ppos >> PAGE_CACHE_SHIFT;
-		offset   =  0;
+	switch (cmd) {
+	case _FIO_SEEK_DATA:
+	case _FIO_SEEK_HOLE:
+		if (!S_ISREG(inode->i_mode))
+			return -EINVAL;
+		if (copy_from_user(&off, (loff_t __user *)arg, sizeof(off)))
+			return -EFAULT;
+		err = lzfs_seek_data_hole(inode, cmd == _FIO_SEEK_DATA ? 
+				SEEK_DATA : SEEK_HOLE, &off);
+		tsd_exit();
+		if (!err && copy_to_user((loff_t __user *)arg, &off, sizeof(off)))
+			err = -EFAULT;
+		return err;
+	case LZFS_IOC_COPY_RANGE:
+		return lzfs_ioc_copy_range(filep, arg);
 	}
+	return -ENOTTY;
+}
 
-out_success:
-	tsd_exit();
-	EXIT;
-	return ((ssize_t) written);
-out_error:
-	tsd_exit();
-	EXIT;
-	return err;
+#ifdef CONFIG_COMPAT
+/* The arguments of all the commands have the same layout on 32 bit */
+static long
+lzfs_fop_compat_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+{
+	return lzfs_fop_ioctl(filep, cmd, (unsigned long)compat_ptr(arg));
 }
+#endif
 
-/* 
- * fops->open is not needed for default operations, but in case mmap is 
- * called on an opened file we need strcut file *, save it in vnode_t
- * */
-static int lzfs_vnop_open(struct inode *inode, struct file *file)
+/*
+ * Pages brought in through a mapping are copies of ARC buffers, so a file
+ * that has been mmapped keeps its hot data in memory twice. ARC buffers 
+ * cannot be loaned to the page cache through the vnode interface, but 
+ * once the last mapping goes away the clean page cache copies serve no 
+ * purpose that the ARC does not: with lzfs_mmap_single_copy set they are 
+ * dropped at unmap and reads go back to being served from the ARC alone.
+ * Dirty and locked pages are left for writeback.
+ */
+static int lzfs_mmap_single_copy = 0;
+module_param(lzfs_mmap_single_copy, int, 0644);
+MODULE_PARM_DESC(lzfs_mmap_single_copy, "Drop clean cached pages when the last mapping of a file goes away");
+
+/*
+ * VMMAPPED tells the write paths that the page cache has to be kept 
+ * coherent with writes. It is set for as long as a vma maps the file: 
+ * lz_mapcnt counts them, from mmap and from vm open (fork, vma splits) 
+ * down to vm close.
+ */
+static void
+lzfs_vm_open(struct vm_area_struct *vma)
 {
-	vnode_t *vp = NULL;
-	int rc;
+	vnode_t *vp = LZFS_ITOV(vma->vm_file->f_mapping->host);
 
-	if ((rc = generic_file_open(inode, file)) < 0)
-		goto out;
+	mutex_enter(&vp->v_lock);
+	LZFS_VTOLZ(vp)->lz_mapcnt++;
+	vp->v_flag |= VMMAPPED;
+	mutex_exit(&vp->v_lock);
+}
+
+static void
+lzfs_vm_close(struct vm_area_struct *vma)
+{
+	struct address_space *mapping = vma->vm_file->f_mapping;
+	vnode_t *vp = LZFS_ITOV(mapping->host);
+	int mapped;
 
-	vp = LZFS_ITOV(inode);
 	mutex_enter(&vp->v_lock);
-	/* save struct file * */
-	vp->v_file = file;
+	mapped = --LZFS_VTOLZ(vp)->lz_mapcnt;
+	if (!mapped)
+		vp->v_flag &= ~VMMAPPED;
 	mutex_exit(&vp->v_lock);
-out:
-	return rc;
+
+	if (lzfs_mmap_single_copy && !mapped && mapping->nrpages)
+		invalidate_mapping_pages(mapping, 0, -1);
 }
 
-const struct inode_operations zfs_symlink_inode_operations = {
-    .readlink       = generic_readlink,
-    .follow_link    = lzfs_follow_link,
-    .put_link       = lzfs_put_link,
+static int lzfs_vm_page_mkwrite(struct vm_area_struct *vma, 
+		struct vm_fault *vmf);
+
+static const struct vm_operations_struct lzfs_file_vm_ops = {
+	.fault		= filemap_fault,
+	.page_mkwrite	= lzfs_vm_page_mkwrite,
+	.open		= lzfs_vm_open,
+	.close		= lzfs_vm_close,
 };
 
 int lzfs_file_mmap(struct file * file, struct vm_area_struct * vma)
 {
 	struct address_space *mapping = file->f_mapping;
-	vnode_t *vp = LZFS_ITOV(mapping->host);
 	int rc;
 
+	/* faults read through ZFS, which has the old size until then */
+	lzfs_free_wait(mapping->host);
 	rc = generic_file_mmap(file, vma);
 	if (rc < 0)
 		return rc;
 
-	vp->v_flag |= VMMAPPED;
+	vma->vm_ops = &lzfs_file_vm_ops;
+	lzfs_vm_open(vma);
+	/* no more buffering once mapped, and faults must see what was */
+	lzfs_wb_flush(mapping->host);
 	return rc;
 }
 
@@ -1045,17 +3114,27 @@ const struct inode_operations zfs_inode_operations = {
 	.rename         = lzfs_vnop_rename,
 	.setattr        = lzfs_vnop_setattr,
 	.permission     = lzfs_vnop_permission,
+	.fiemap         = lzfs_vnop_fiemap,
+	.fallocate      = lzfs_vnop_fallocate,
 };
 
 const struct file_operations zfs_file_operations = {
-    .open               = lzfs_vnop_open,
-    //.llseek           = generic_file_llseek,
-    .read               = lzfs_vnop_read,
-    .write              = lzfs_vnop_write,
+    .open               = generic_file_open,
+    .llseek             = lzfs_vnop_llseek,
+    .read               = lzfs_file_read,
+    .write              = lzfs_file_write,
+    .aio_read           = lzfs_vnop_aio_read,
+    .aio_write          = lzfs_vnop_aio_write,
     .readdir            = lzfs_vnop_readdir,
     .mmap               = lzfs_file_mmap,
-    //.unlocked_ioctl   = lzfs_fop_ioctl,
+    .splice_read        = lzfs_file_splice_read,
+    .splice_write       = lzfs_file_splice_write,
+    .unlocked_ioctl     = lzfs_fop_ioctl,
+#ifdef CONFIG_COMPAT
+    .compat_ioctl       = lzfs_fop_compat_ioctl,
+#endif
     .fsync              = lzfs_vnop_fsync,
+    .flush              = lzfs_vnop_flush,
 };
 
 const struct inode_operations zfs_dir_inode_operations ={
@@ -1073,7 +3152,7 @@ const struct inode_operations zfs_dir_inode_operations ={
 };
 
 const struct file_operations zfs_dir_file_operations = {
-//	.llseek         = generic_file_llseek,
+	.llseek         = generic_file_llseek,
 //	.read           = generic_read_dir,
 	.readdir        = lzfs_vnop_readdir,
 //     .unlocked_ioctl = lzfs_fop_ioctl,
@@ -1081,155 +3160,344 @@ const struct file_operations zfs_dir_file_operations = {
 
 };
 
-static int lzfs_readpage(struct file *file, struct page *page)
+/*
+ * Fills nr locked, contiguous pages of a file with a single zfs_read and 
+ * unlocks them. Used by readpage and by readpages, which hands in up to a 
+ * record worth of pages at a time.
+ */
+static int 
+lzfs_fill_pages(struct address_space *mapping, struct page **pages, 
+		unsigned int nr)
 {
     const cred_t *cred  = get_current_cred();
-    struct inode *inode = NULL;
-    loff_t i_size       = 0;
-    loff_t offset       = 0;
+    struct inode *inode = mapping->host;
+    vnode_t *vp         = LZFS_ITOV(inode);
+    loff_t i_size       = i_size_read(inode);
+    loff_t offset       = page_offset(pages[0]);
+    size_t fillsize     = 0;
+    size_t len          = 0;
     int err             = 0;
-    char *buf           = NULL;
-    vnode_t *vp         = NULL;
-    unsigned long fillsize = 0;
-    struct iovec iov;
+    struct iovec iov[LZFS_READPAGES_MAX];
+    unsigned int i;
     uio_t uio;
 
-    BUG_ON(!PageLocked(page));
-//    printk(KERN_ERR "%s: ==>\n", __FUNCTION__);
-    inode  = page->mapping->host;
-    vp     = LZFS_ITOV(inode);
-    i_size = i_size_read(inode);
-    offset = page_offset(page);
-
-    /* Is the page fully outside i_size? (truncate in progress) */
-    if (unlikely(page->index >= (i_size + PAGE_CACHE_SIZE - 1) >>
-                PAGE_CACHE_SHIFT)) {
-        zero_user(page, 0, PAGE_CACHE_SIZE);
-        printk(KERN_ERR "Read outside i_size - truncated?");
-        goto done;
-    }
+    BUG_ON(nr > LZFS_READPAGES_MAX);
 
-    if (NULL == (buf = kmap(page))) {
-        err = -ENOMEM;
-        goto out;
+    for (i = 0; i < nr; i++) {
+        BUG_ON(!PageLocked(pages[i]));
+        iov[i].iov_base = kmap(pages[i]);
+        iov[i].iov_len  = PAGE_CACHE_SIZE;
     }
 
-    bzero(&iov, sizeof(struct iovec));
-    bzero(&uio, sizeof(uio_t));
-
+    /* pages fully outside i_size (truncate in progress) are only zeroed */
     if (offset < i_size) {
-        i_size -= offset;
-        fillsize = i_size > PAGE_CACHE_SIZE ? PAGE_CACHE_SIZE : i_size;
+        len = (size_t) nr << PAGE_CACHE_SHIFT;
+        if (len > i_size - offset)
+            len = i_size - offset;
 
-        iov.iov_base    = buf;
-        iov.iov_len     = fillsize;
-
-        uio.uio_iov     = &iov;
-        uio.uio_iovcnt  = 1;
+        bzero(&uio, sizeof(uio_t));
+        uio.uio_iov     = iov;
+        uio.uio_iovcnt  = (len + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
         uio.uio_loffset = (offset_t)(offset);
-        uio.uio_resid   = fillsize;
+        uio.uio_resid   = len;
         uio.uio_segflg  = UIO_SYSSPACE;
 
         err = zfs_read(vp, &uio, 0, (cred_t *) cred, NULL);
-        if (err) {
-            SetPageError(page);
-            fillsize = 0;
+        lzfs_attr_accessed(mapping->host);
+        if (err)
             err = -EIO;
-        }
+        else
+            fillsize = len - uio.uio_resid;
     }
 
-    if (fillsize < PAGE_CACHE_SIZE)
-        memset(buf + fillsize, 0, PAGE_CACHE_SIZE - fillsize);
+    for (i = 0; i < nr; i++) {
+        size_t start = (size_t) i << PAGE_CACHE_SHIFT;
 
-    if (err == 0)
-        SetPageUptodate(page);
-
-    flush_dcache_page(page);
-    kunmap(page);
+        if (fillsize < start + PAGE_CACHE_SIZE) {
+            size_t valid = fillsize > start ? fillsize - start : 0;
+            memset(iov[i].iov_base + valid, 0, PAGE_CACHE_SIZE - valid);
+        }
+        flush_dcache_page(pages[i]);
+        kunmap(pages[i]);
+
+        if (err)
+            SetPageError(pages[i]);
+        else
+            SetPageUptodate(pages[i]);
+        unlock_page(pages[i]);
+    }
 
-done:
-    SetPageUptodate(page);
-out:
-    unlock_page(page);
-//    printk(KERN_ERR "%s: <==\n", __FUNCTION__);
     put_cred(cred);
     return err;
 }
 
-static int lzfs_writepage(struct page *page, struct writeback_control *wbc)
+static int lzfs_readpage(struct file *file, struct page *page)
 {
-    struct inode *inode = NULL;
-    loff_t i_size       = 0;
-    loff_t offset       = 1;
-    ssize_t len         = 0;
-    int err             = 0;
-    char *buf           = NULL;
-    vnode_t *vp         = NULL;
-    struct file *filep  = NULL;
+    return lzfs_fill_pages(page->mapping, &page, 1);
+}
 
-//    printk(KERN_ERR "%s: ==>\n", __FUNCTION__);
-    inode  = page->mapping->host;
-    vp     = LZFS_ITOV(inode);
-    filep  = vp->v_file;
-    i_size = i_size_read(inode);
-    offset = page_offset(page);
+typedef struct lzfs_ra {
+	struct address_space	*lr_mapping;
+	unsigned int		lr_nr;
+	struct page		*lr_pages[LZFS_READPAGES_MAX];
+} lzfs_ra_t;
 
-    BUG_ON(!PageLocked(page));
-    BUG_ON(!filep);
+static void
+lzfs_readpages_work(void *arg)
+{
+    lzfs_ra_t *ra = (lzfs_ra_t *)arg;
 
-    if (NULL == (buf = kmap(page))) {
-        err = -ENOMEM;
-        goto out;
+    lzfs_fill_pages(ra->lr_mapping, ra->lr_pages, ra->lr_nr);
+    while (ra->lr_nr)
+        page_cache_release(ra->lr_pages[--ra->lr_nr]);
+    kfree(ra);
+    tsd_exit();
+}
+
+/*
+ * Fills a run of locked pages and drops the readahead references on them,
+ * either right away or, when async is set, from the lzfs_ra taskq. Readers
+ * wait for queued pages on the page lock.
+ */
+static void
+lzfs_readpages_submit(struct address_space *mapping, struct page **pages,
+		unsigned int nr, int async)
+{
+    lzfs_ra_t *ra;
+
+    if (async && lzfs_ra_taskq && 
+        (ra = kmalloc(sizeof(lzfs_ra_t), GFP_KERNEL)) != NULL) {
+        ra->lr_mapping = mapping;
+        ra->lr_nr      = nr;
+        memcpy(ra->lr_pages, pages, nr * sizeof(struct page *));
+        if (taskq_dispatch(lzfs_ra_taskq, lzfs_readpages_work, ra, 
+            TQ_NOSLEEP))
+            return;
+        kfree(ra);
     }
 
-#if 0 
-    for (i = 0; i < PAGE_CACHE_SIZE; i++) {
-        if (buf[i] != 0) {
-            printk(KERN_ERR "%c", buf[i]);
+    lzfs_fill_pages(mapping, pages, nr);
+    while (nr)
+        page_cache_release(pages[--nr]);
+}
+
+/*
+ * Called by the kernel readahead code (mmap faults, fadvise, readahead(2)
+ * and streaming reads) with a window sized from the file_ra_state. The 
+ * window is split in record aligned runs of contiguous pages, each filled
+ * with one zfs_read. The first run, which holds the page the caller is 
+ * usually waiting for, is read here and the rest in parallel by lzfs_ra.
+ */
+static int 
+lzfs_readpages(struct file *file, struct address_space *mapping,
+		struct list_head *pages, unsigned nr_pages)
+{
+    struct page *batch[LZFS_READPAGES_MAX];
+    loff_t recsize   = mapping->host->i_sb->s_blocksize;
+    unsigned int max = recsize >> PAGE_CACHE_SHIFT;
+    unsigned int nr  = 0;
+    int async        = 0;
+    struct page *page;
+
+    if (max > LZFS_READPAGES_MAX)
+        max = LZFS_READPAGES_MAX;
+    if (max == 0)
+        max = 1;
+
+    /* pages are queued in reverse order of their index */
+    while (!list_empty(pages)) {
+        page = list_entry(pages->prev, struct page, lru);
+        list_del(&page->lru);
+
+        if (add_to_page_cache_lru(page, mapping, page->index, GFP_KERNEL)) {
+            /* somebody else cached it already */
+            page_cache_release(page);
+            continue;
+        }
+
+        if (nr && (nr == max || batch[nr - 1]->index + 1 != page->index ||
+            !(page_offset(page) & (recsize - 1)))) {
+            lzfs_readpages_submit(mapping, batch, nr, async);
+            nr = 0;
+            async = 1;
         }
+        batch[nr++] = page;
     }
-    printk(KERN_ERR "\n");
-#endif
 
-    /* WE ARE USING PAGE CACHE ONLY FOR MMAP, WE WOULD NEVER HAVE TO 
-     * INCREASE THE SIZE OF A FILE IN writepage */
-    len = PAGE_CACHE_SIZE;
-    if ((offset + len) > i_size) {
-        len = i_size & ~PAGE_CACHE_MASK;
+    if (nr)
+        lzfs_readpages_submit(mapping, batch, nr, async);
+    return 0;
+}
+
+/*
+ * Writes back nr contiguous pages, which are under writeback and unlocked,
+ * with a single zfs_write and ends their writeback. The data goes to the 
+ * offset of the pages whatever the flags of the files that have the inode
+ * open, so writeback needs none of them. Pages truncated away meanwhile 
+ * are skipped.
+ */
+static int
+lzfs_write_pages(struct address_space *mapping, struct page **pages, 
+		unsigned int nr)
+{
+    struct inode *inode = mapping->host;
+    vnode_t *vp         = LZFS_ITOV(inode);
+    loff_t i_size       = i_size_read(inode);
+    loff_t offset       = page_offset(pages[0]);
+    size_t len          = 0;
+    ssize_t ret;
+    int err             = 0;
+    struct iovec iov[LZFS_READPAGES_MAX];
+    unsigned int i, n;
+
+    BUG_ON(nr > LZFS_READPAGES_MAX);
+
+    for (n = 0; n < nr; n++) {
+        loff_t pos = page_offset(pages[n]);
+
+        if (pos >= i_size)
+            break;
+        iov[n].iov_base = kmap(pages[n]);
+        iov[n].iov_len  = min_t(loff_t, PAGE_CACHE_SIZE, i_size - pos);
+        len += iov[n].iov_len;
     }
 
-    /*
-     * zfs_write handles the FAPPEND flag by changing the file offset 
-     * to the end of the file, but the we are in writepage and data 
-     * should be written to same offset that we provide to zfs_write.
-     * */
-	err = lzfs_write(vp, filep->f_flags & ~FAPPEND, buf, len, offset, UIO_SYSSPACE);
-    if (err) {
-        SetPageError(page);
-        err = -EIO;
+    if (n) {
+        ret = lzfs_writev(vp, 0, iov, n, &offset, UIO_SYSSPACE);
+        if (ret < 0 || ret < len)
+            err = -EIO;
+        for (i = 0; i < n; i++)
+            kunmap(pages[i]);
     }
-    kunmap(page);
-    SetPageUptodate(page);
-out:
-    //	page_clear_dirty(page);
+
+    for (i = 0; i < nr; i++) {
+        if (err && i < n) {
+            SetPageError(pages[i]);
+            mapping_set_error(mapping, err);
+        }
+        end_page_writeback(pages[i]);
+    }
+    return err;
+}
+
+static int lzfs_writepage(struct page *page, struct writeback_control *wbc)
+{
+    int err;
+
+    BUG_ON(!PageLocked(page));
+
+    set_page_writeback(page);
     unlock_page(page);
-//    printk(KERN_ERR "%s: <==\n", __FUNCTION__);
+    err = lzfs_write_pages(page->mapping, &page, 1);
+    tsd_exit();
     return err;
 }
 
+/*
+ * writepages gathers the contiguous dirty pages write_cache_pages hands out
+ * into runs of up to a record, each one zfs_write and so one transaction
+ * rather than one per page.
+ */
+typedef struct lzfs_wp {
+    struct page     *lw_pages[LZFS_READPAGES_MAX];
+    unsigned int    lw_nr;
+    unsigned int    lw_max;     /* pages per record */
+    int             lw_err;
+} lzfs_wp_t;
+
+static void
+lzfs_writepages_flush(struct address_space *mapping, lzfs_wp_t *wp)
+{
+    int err;
+
+    if (!wp->lw_nr)
+        return;
+    err = lzfs_write_pages(mapping, wp->lw_pages, wp->lw_nr);
+    if (err && !wp->lw_err)
+        wp->lw_err = err;
+    wp->lw_nr = 0;
+}
+
+static int
+lzfs_writepages_add(struct page *page, struct writeback_control *wbc, 
+		void *data)
+{
+    struct address_space *mapping = page->mapping;
+    lzfs_wp_t *wp = (lzfs_wp_t *)data;
+
+    /* runs end at record boundaries and at gaps */
+    if (wp->lw_nr && 
+        (page->index != wp->lw_pages[wp->lw_nr - 1]->index + 1 ||
+         (page->index % wp->lw_max) == 0))
+        lzfs_writepages_flush(mapping, wp);
+
+    set_page_writeback(page);
+    unlock_page(page);
+    wp->lw_pages[wp->lw_nr++] = page;
+
+    if (wp->lw_nr == wp->lw_max)
+        lzfs_writepages_flush(mapping, wp);
+    return 0;
+}
+
+static int
+lzfs_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+    struct super_block *sb = mapping->host->i_sb;
+    lzfs_wp_t wp;
+    int err;
+
+    wp.lw_nr  = 0;
+    wp.lw_err = 0;
+    wp.lw_max = sb->s_blocksize >> PAGE_CACHE_SHIFT;
+    if (wp.lw_max == 0)
+        wp.lw_max = 1;
+    if (wp.lw_max > LZFS_READPAGES_MAX)
+        wp.lw_max = LZFS_READPAGES_MAX;
+
+    err = write_cache_pages(mapping, wbc, lzfs_writepages_add, &wp);
+    lzfs_writepages_flush(mapping, &wp);
+    tsd_exit();
+    return err ? err : wp.lw_err;
+}
+
+/*
+ * Shared writable mappings fault here before a clean page is written to, 
+ * so the page is dirtied, and later written back, exactly when it is 
+ * modified. A page truncated away in the meantime is refaulted.
+ */
+static int
+lzfs_vm_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+    struct page *page = vmf->page;
+    struct inode *inode = vma->vm_file->f_mapping->host;
+
+    lock_page(page);
+    if (page->mapping != inode->i_mapping || 
+        page_offset(page) >= i_size_read(inode)) {
+        unlock_page(page);
+        return VM_FAULT_NOPAGE;
+    }
+
+    wait_on_page_writeback(page);
+    set_page_dirty(page);
+    return VM_FAULT_LOCKED;
+}
 
 static ssize_t
 lzfs_direct_IO(int rw, struct kiocb *iocb, const struct iovec *iov,
                         loff_t offset, unsigned long nr_segs)
 {
-        BUG_ON(1);
-        return -1;
+	return lzfs_direct_rw(rw, iocb->ki_filp, iov, nr_segs, &offset);
 }
 
 
 const struct address_space_operations zfs_address_space_operations = {
 	.readpage = lzfs_readpage,
+	.readpages = lzfs_readpages,
 	.writepage = lzfs_writepage,
+	.writepages = lzfs_writepages,
+	.set_page_dirty = __set_page_dirty_nobuffers,
 	.direct_IO = lzfs_direct_IO,
 };
 
@@ -1245,6 +3513,9 @@ lzfs_set_inode_ops(struct inode *inode)
 	       __FUNCTION__, inode->i_ino, inode->i_mode);
 */
 
+	/* dirty pages are accounted to the mount, see lzfs_fill_super */
+	inode->i_mapping->backing_dev_info = inode->i_sb->s_bdi;
+
 	switch (inode->i_mode & S_IFMT) {
 	case S_IFREG:
 	    inode->i_op = &zfs_inode_operations;